@@ -0,0 +1,206 @@
+/*
+ * Access log
+ *
+ * The request path only copies a fixed-size record into a single-producer, single-consumer ring
+ * buffer - no locks and no syscalls. A background thread formats the records and appends them to
+ * the log file in batches. On SIGUSR1 the file is reopened, eg. after logrotate moved it away.
+ *
+ * One line per request, fields separated by spaces:
+ *   time (unix, ms), client address, user, method, status (0 or error code), bytes in, bytes out,
+ *   latency (us)
+ *
+ * Copyright (C) 2009-2010 Pawel Foremski <pawel@foremski.pl>
+ *
+ * Licensed under GPLv3
+ */
+
+#define _GNU_SOURCE 1
+
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "common.h"
+
+#define ALOG_SLOTS 1024                /** ring buffer size, must be a power of 2 */
+#define ALOG_FLUSH 100                 /** how often to write records, in ms */
+#define ALOG_BATCH 65536               /** max size of single write */
+
+struct arec {
+	long long time;                    /** request time, in ms */
+	int code;                          /** 0 or error code */
+	unsigned int in;                   /** request size */
+	unsigned int out;                  /** reply size */
+	unsigned int usec;                 /** latency */
+	char addr[48];                     /** client address */
+	char user[32];                     /** authenticated user */
+	char method[96];                   /** called method */
+};
+
+static struct {
+	const char *path;                  /** log file path */
+	int fd;                            /** log file */
+	struct arec rec[ALOG_SLOTS];       /** the ring */
+	volatile unsigned int head;        /** next slot to fill, written by producer only */
+	volatile unsigned int tail;        /** next slot to write, written by consumer only */
+	volatile unsigned int dropped;     /** records dropped because the ring was full */
+	volatile sig_atomic_t reopen;      /** if true, reopen the file */
+} L = { .fd = -1 };
+
+static void sigusr1(int sig)
+{
+	L.reopen = 1;
+}
+
+static void copy(char *dst, const char *src, size_t size)
+{
+	size_t i;
+
+	if (!src || !src[0])
+		src = "-";
+
+	/* keep the line parseable */
+	for (i = 0; src[i] && i < size - 1; i++)
+		dst[i] = (src[i] == ' ' || src[i] == '\n' || src[i] == '\r') ? '_' : src[i];
+
+	dst[i] = '\0';
+}
+
+/** Write all records from the ring to the file
+ * @note the lock is only taken by consumers: the writer thread and alog_exit() */
+static void flush(char *buf)
+{
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	unsigned int head, len = 0, lost;
+	struct arec *r;
+
+	pthread_mutex_lock(&lock);
+
+	if (L.reopen) {
+		L.reopen = 0;
+		close(L.fd);
+		L.fd = open(L.path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+	}
+
+	head = L.head;
+	__sync_synchronize(); /* read records only after seeing head */
+
+	while (L.tail != head) {
+		r = &L.rec[L.tail & (ALOG_SLOTS - 1)];
+
+		len += snprintf(buf + len, ALOG_BATCH - len, "%lld.%03d %s %s %s %d %u %u %u\n",
+			r->time / 1000, (int) (r->time % 1000),
+			r->addr, r->user, r->method, r->code, r->in, r->out, r->usec);
+
+		__sync_synchronize(); /* done reading the slot before giving it back */
+		L.tail++;
+
+		if (len > ALOG_BATCH - 256) {
+			if (L.fd >= 0) write(L.fd, buf, len);
+			len = 0;
+		}
+	}
+
+	if ((lost = L.dropped) > 0) {
+		__sync_fetch_and_sub(&L.dropped, lost);
+		len += snprintf(buf + len, ALOG_BATCH - len, "# %u records dropped\n", lost);
+	}
+
+	if (len > 0 && L.fd >= 0)
+		write(L.fd, buf, len);
+
+	pthread_mutex_unlock(&lock);
+}
+
+static void *writer(void *arg)
+{
+	struct timespec ts = { ALOG_FLUSH / 1000, (ALOG_FLUSH % 1000) * 1000000 };
+	char *buf = arg;
+
+	for (;;) {
+		nanosleep(&ts, NULL);
+		flush(buf);
+	}
+
+	return NULL;
+}
+
+/** Write what is left on exit */
+static void alog_exit(void)
+{
+	static char buf[ALOG_BATCH];
+
+	flush(buf);
+}
+
+bool alog_init(const char *path)
+{
+	struct sigaction sa;
+	pthread_attr_t attr;
+	pthread_t tid;
+	sigset_t set, old;
+
+	L.fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+	if (L.fd == -1) {
+		dbg(0, "%s: could not open access log: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = sigusr1;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	/* signals are for the main thread */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&tid, &attr, writer, malloc(ALOG_BATCH)) != 0) {
+		dbg(0, "could not start access log writer\n");
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		return false;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+
+	L.path = path;
+	atexit(alog_exit);
+	return true;
+}
+
+void alog_add(struct req *req, unsigned int usec)
+{
+	struct timespec ts;
+	struct arec *r;
+
+	if (!L.path)
+		return;
+
+	if (L.head - L.tail >= ALOG_SLOTS) {
+		__sync_fetch_and_add(&L.dropped, 1);
+		return;
+	}
+
+	r = &L.rec[L.head & (ALOG_SLOTS - 1)];
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r->time = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+	r->code = ut_ok(req->reply) ? 0 : ut_errcode(req->reply);
+	r->in = req->insize;
+	r->out = req->outsize;
+	r->usec = usec;
+	copy(r->addr, req->addr, sizeof r->addr);
+	copy(r->user, req->user, sizeof r->user);
+	copy(r->method, req->method, sizeof r->method);
+
+	__sync_synchronize(); /* publish the record before moving head */
+	L.head++;
+}
+
+/* for Vim autocompletion:
+ * vim: path=.,/usr/include,/usr/local/include,~/local/include
+ */
@@ -0,0 +1,21 @@
+/*
+ * Access log, see alog.c
+ *
+ * Copyright (C) 2009-2010 Pawel Foremski <pawel@foremski.pl>
+ *
+ * Licensed under GPLv3
+ */
+
+#ifndef _ALOG_H_
+#define _ALOG_H_
+
+/** Open access log and start its writer thread
+ * @param path    log file, reopened on SIGUSR1
+ * @retval false  failed */
+bool alog_init(const char *path);
+
+/** Log finished request, unless the log is disabled
+ * @param usec    time it took to handle the request */
+void alog_add(struct req *req, unsigned int usec);
+
+#endif
@@ -0,0 +1,597 @@
+/*
+ * MessagePack and CBOR encoding of unitype objects
+ *
+ * Copyright (C) 2009-2010 Pawel Foremski <pawel@foremski.pl>
+ *
+ * Licensed under GPLv3
+ */
+
+#include <math.h>
+#include "common.h"
+
+#define MAX_DEPTH  64                  /** max nesting of lists and hashes */
+#define MAX_ITEM   (64 * 1024 * 1024)  /** max length of a single string */
+
+/** Source of bytes to decode - memory buffer or a stream */
+struct src {
+	const unsigned char *p;            /** current position in buffer */
+	const unsigned char *end;          /** end of buffer */
+	FILE *fp;                          /** if not NULL, read from here instead */
+	void *mm;                          /** where to allocate decoded objects */
+	const char *error;                 /** if not NULL, decoding failed */
+};
+
+/***************************************************************************************************/
+
+static void put(xstr *xs, const void *data, size_t len)
+{
+	xstr_append_size(xs, data, len);
+}
+
+/** Append val as n-byte big-endian number */
+static void put_be(xstr *xs, uint64_t val, int n)
+{
+	unsigned char buf[8];
+	int i;
+
+	for (i = n - 1; i >= 0; i--, val >>= 8)
+		buf[i] = val & 0xff;
+
+	put(xs, buf, n);
+}
+
+static void put_byte(xstr *xs, unsigned char c)
+{
+	put(xs, &c, 1);
+}
+
+static uint64_t double_bits(double d)
+{
+	uint64_t u;
+
+	memcpy(&u, &d, sizeof u);
+	return u;
+}
+
+/***************************************************************************************************/
+
+static bool take(struct src *s, void *dst, size_t len)
+{
+	if (s->fp) {
+		if (fread(dst, 1, len, s->fp) != len) {
+			s->error = "Unexpected end of input";
+			return false;
+		}
+	} else {
+		if ((size_t) (s->end - s->p) < len) {
+			s->error = "Unexpected end of input";
+			return false;
+		}
+
+		memcpy(dst, s->p, len);
+		s->p += len;
+	}
+
+	return true;
+}
+
+/** Read n-byte big-endian number */
+static uint64_t take_be(struct src *s, int n)
+{
+	unsigned char buf[8];
+	uint64_t val = 0;
+	int i;
+
+	if (!take(s, buf, n))
+		return 0;
+
+	for (i = 0; i < n; i++)
+		val = (val << 8) | buf[i];
+
+	return val;
+}
+
+static double bits_double(uint64_t u)
+{
+	double d;
+
+	memcpy(&d, &u, sizeof d);
+	return d;
+}
+
+static double bits_float(uint32_t u)
+{
+	float f;
+
+	memcpy(&f, &u, sizeof f);
+	return f;
+}
+
+/** Convert integer to unitype, falling back to double if it does not fit in int */
+static ut *new_int(struct src *s, int64_t val)
+{
+	if (val >= INT32_MIN && val <= INT32_MAX)
+		return ut_new_int(val, s->mm);
+	else
+		return ut_new_double(val, s->mm);
+}
+
+static ut *new_uint(struct src *s, uint64_t val)
+{
+	if (val <= INT32_MAX)
+		return ut_new_int(val, s->mm);
+	else
+		return ut_new_double(val, s->mm);
+}
+
+/** Read string of given length */
+static char *take_str(struct src *s, uint64_t len)
+{
+	char *str;
+
+	if (len > MAX_ITEM) {
+		s->error = "String too long";
+		return NULL;
+	}
+
+	/* do not allocate for a length the buffer can not hold */
+	if (!s->fp && (size_t) (s->end - s->p) < len) {
+		s->error = "Unexpected end of input";
+		return NULL;
+	}
+
+	str = mmatic_alloc(len + 1, s->mm);
+	if (!take(s, str, len))
+		return NULL;
+
+	str[len] = '\0';
+	return str;
+}
+
+/***************************************************************************************************/
+/* MessagePack */
+
+static void mp_print(xstr *xs, ut *obj)
+{
+	int i;
+	const char *k, *str;
+	ut *v;
+
+	switch (ut_type(obj)) {
+		case T_BOOL:
+			put_byte(xs, ut_bool(obj) ? 0xc3 : 0xc2);
+			break;
+
+		case T_INT:
+			i = ut_int(obj);
+
+			if (i >= 0) {
+				if (i < 128)          put_byte(xs, i);
+				else if (i <= 0xff)   { put_byte(xs, 0xcc); put_be(xs, i, 1); }
+				else if (i <= 0xffff) { put_byte(xs, 0xcd); put_be(xs, i, 2); }
+				else                  { put_byte(xs, 0xce); put_be(xs, i, 4); }
+			} else {
+				if (i >= -32)         put_byte(xs, i & 0xff);
+				else if (i >= -128)   { put_byte(xs, 0xd0); put_be(xs, (uint8_t) i, 1); }
+				else if (i >= -32768) { put_byte(xs, 0xd1); put_be(xs, (uint16_t) i, 2); }
+				else                  { put_byte(xs, 0xd2); put_be(xs, (uint32_t) i, 4); }
+			}
+			break;
+
+		case T_DOUBLE:
+			put_byte(xs, 0xcb);
+			put_be(xs, double_bits(ut_double(obj)), 8);
+			break;
+
+		case T_STRING:
+			str = ut_char(obj);
+			i = strlen(str);
+
+			if (i < 32)           put_byte(xs, 0xa0 | i);
+			else if (i < 0x100)   { put_byte(xs, 0xd9); put_be(xs, i, 1); }
+			else if (i < 0x10000) { put_byte(xs, 0xda); put_be(xs, i, 2); }
+			else                  { put_byte(xs, 0xdb); put_be(xs, i, 4); }
+
+			put(xs, str, i);
+			break;
+
+		case T_LIST:
+			i = tlist_count(ut_tlist(obj));
+
+			if (i < 16)           put_byte(xs, 0x90 | i);
+			else if (i < 0x10000) { put_byte(xs, 0xdc); put_be(xs, i, 2); }
+			else                  { put_byte(xs, 0xdd); put_be(xs, i, 4); }
+
+			TLIST_ITER_LOOP(ut_tlist(obj), v)
+				mp_print(xs, v);
+			break;
+
+		case T_HASH:
+			i = thash_count(ut_thash(obj));
+
+			if (i < 16)           put_byte(xs, 0x80 | i);
+			else if (i < 0x10000) { put_byte(xs, 0xde); put_be(xs, i, 2); }
+			else                  { put_byte(xs, 0xdf); put_be(xs, i, 4); }
+
+			THASH_ITER_LOOP(ut_thash(obj), k, v) {
+				mp_print(xs, ut_new_char(k, xs));
+				mp_print(xs, v);
+			}
+			break;
+
+		case T_ERR:
+			put_byte(xs, 0x82);
+			mp_print(xs, ut_new_char("code", xs));
+			mp_print(xs, ut_new_int(ut_errcode(obj), xs));
+			mp_print(xs, ut_new_char("message", xs));
+			mp_print(xs, ut_new_char(ut_err(obj), xs));
+			break;
+
+		case T_NULL:
+		case T_PTR:
+			put_byte(xs, 0xc0);
+			break;
+	}
+}
+
+static ut *mp_parse(struct src *s, int depth);
+
+static ut *mp_list(struct src *s, uint64_t n, int depth)
+{
+	tlist *tl = tlist_create(NULL, s->mm);
+	ut *v;
+
+	while (n-- > 0) {
+		if (!(v = mp_parse(s, depth + 1)))
+			return NULL;
+
+		tlist_push(tl, v);
+	}
+
+	return ut_new_tlist(tl, s->mm);
+}
+
+static ut *mp_hash(struct src *s, uint64_t n, int depth)
+{
+	thash *th = thash_create_strkey(NULL, s->mm);
+	ut *k, *v;
+
+	while (n-- > 0) {
+		if (!(k = mp_parse(s, depth + 1)) || !(v = mp_parse(s, depth + 1)))
+			return NULL;
+
+		if (ut_type(k) != T_STRING) {
+			s->error = "Hash key must be a string";
+			return NULL;
+		}
+
+		thash_set(th, ut_char(k), v);
+	}
+
+	return ut_new_thash(th, s->mm);
+}
+
+static ut *mp_parse(struct src *s, int depth)
+{
+	unsigned char c;
+	char *str;
+
+	if (depth > MAX_DEPTH) {
+		s->error = "Nesting too deep";
+		return NULL;
+	}
+
+	if (!take(s, &c, 1))
+		return NULL;
+
+	if (c <= 0x7f) return ut_new_int(c, s->mm);
+	if (c >= 0xe0) return ut_new_int((int8_t) c, s->mm);
+	if ((c & 0xf0) == 0x80) return mp_hash(s, c & 0x0f, depth);
+	if ((c & 0xf0) == 0x90) return mp_list(s, c & 0x0f, depth);
+	if ((c & 0xe0) == 0xa0) { str = take_str(s, c & 0x1f); goto string; }
+
+	switch (c) {
+		case 0xc0: return ut_new_null(s->mm);
+		case 0xc2: return ut_new_bool(false, s->mm);
+		case 0xc3: return ut_new_bool(true, s->mm);
+		case 0xca: return ut_new_double(bits_float(take_be(s, 4)), s->mm);
+		case 0xcb: return ut_new_double(bits_double(take_be(s, 8)), s->mm);
+		case 0xcc: return new_uint(s, take_be(s, 1));
+		case 0xcd: return new_uint(s, take_be(s, 2));
+		case 0xce: return new_uint(s, take_be(s, 4));
+		case 0xcf: return new_uint(s, take_be(s, 8));
+		case 0xd0: return new_int(s, (int8_t) take_be(s, 1));
+		case 0xd1: return new_int(s, (int16_t) take_be(s, 2));
+		case 0xd2: return new_int(s, (int32_t) take_be(s, 4));
+		case 0xd3: return new_int(s, (int64_t) take_be(s, 8));
+		case 0xc4:
+		case 0xd9: str = take_str(s, take_be(s, 1)); goto string;
+		case 0xc5:
+		case 0xda: str = take_str(s, take_be(s, 2)); goto string;
+		case 0xc6:
+		case 0xdb: str = take_str(s, take_be(s, 4)); goto string;
+		case 0xdc: return mp_list(s, take_be(s, 2), depth);
+		case 0xdd: return mp_list(s, take_be(s, 4), depth);
+		case 0xde: return mp_hash(s, take_be(s, 2), depth);
+		case 0xdf: return mp_hash(s, take_be(s, 4), depth);
+		default:
+			s->error = "Unsupported MessagePack type";
+			return NULL;
+	}
+
+string:
+	return (str && !s->error) ? ut_new_char(str, s->mm) : NULL;
+}
+
+/***************************************************************************************************/
+/* CBOR (RFC 7049) */
+
+/** Append CBOR initial byte with argument */
+static void cbor_head(xstr *xs, int major, uint64_t val)
+{
+	major <<= 5;
+
+	if (val < 24)               put_byte(xs, major | val);
+	else if (val <= 0xff)       { put_byte(xs, major | 24); put_be(xs, val, 1); }
+	else if (val <= 0xffff)     { put_byte(xs, major | 25); put_be(xs, val, 2); }
+	else if (val <= 0xffffffff) { put_byte(xs, major | 26); put_be(xs, val, 4); }
+	else                        { put_byte(xs, major | 27); put_be(xs, val, 8); }
+}
+
+static void cbor_print(xstr *xs, ut *obj)
+{
+	int i;
+	const char *k, *str;
+	ut *v;
+
+	switch (ut_type(obj)) {
+		case T_BOOL:
+			put_byte(xs, ut_bool(obj) ? 0xf5 : 0xf4);
+			break;
+
+		case T_INT:
+			i = ut_int(obj);
+			if (i >= 0)
+				cbor_head(xs, 0, i);
+			else
+				cbor_head(xs, 1, -1 - (int64_t) i);
+			break;
+
+		case T_DOUBLE:
+			put_byte(xs, 0xfb);
+			put_be(xs, double_bits(ut_double(obj)), 8);
+			break;
+
+		case T_STRING:
+			str = ut_char(obj);
+			i = strlen(str);
+			cbor_head(xs, 3, i);
+			put(xs, str, i);
+			break;
+
+		case T_LIST:
+			cbor_head(xs, 4, tlist_count(ut_tlist(obj)));
+			TLIST_ITER_LOOP(ut_tlist(obj), v)
+				cbor_print(xs, v);
+			break;
+
+		case T_HASH:
+			cbor_head(xs, 5, thash_count(ut_thash(obj)));
+			THASH_ITER_LOOP(ut_thash(obj), k, v) {
+				cbor_print(xs, ut_new_char(k, xs));
+				cbor_print(xs, v);
+			}
+			break;
+
+		case T_ERR:
+			cbor_head(xs, 5, 2);
+			cbor_print(xs, ut_new_char("code", xs));
+			cbor_print(xs, ut_new_int(ut_errcode(obj), xs));
+			cbor_print(xs, ut_new_char("message", xs));
+			cbor_print(xs, ut_new_char(ut_err(obj), xs));
+			break;
+
+		case T_NULL:
+		case T_PTR:
+			put_byte(xs, 0xf6);
+			break;
+	}
+}
+
+/** Decode IEEE 754 half precision float */
+static double half(uint16_t h)
+{
+	int exp = (h >> 10) & 0x1f, mant = h & 0x3ff;
+	double val;
+
+	if (exp == 0)       val = ldexp(mant, -24);
+	else if (exp != 31) val = ldexp(mant + 1024, exp - 25);
+	else                val = mant == 0 ? INFINITY : NAN;
+
+	return (h & 0x8000) ? -val : val;
+}
+
+#define BREAK ((ut *) -1)              /** "break" stop code of indefinite length items */
+
+static ut *cbor_parse(struct src *s, int depth)
+{
+	unsigned char c;
+	int major, info;
+	uint64_t val = 0;
+	bool indef = false;
+	tlist *tl;
+	thash *th;
+	ut *k, *v;
+	char *str;
+
+	if (depth > MAX_DEPTH) {
+		s->error = "Nesting too deep";
+		return NULL;
+	}
+
+	if (!take(s, &c, 1))
+		return NULL;
+
+	major = c >> 5;
+	info = c & 0x1f;
+
+	if (c == 0xff)
+		return BREAK;
+
+	/* simple values and floats carry no length argument */
+	if (major == 7) switch (info) {
+		case 20: return ut_new_bool(false, s->mm);
+		case 21: return ut_new_bool(true, s->mm);
+		case 22:
+		case 23: return ut_new_null(s->mm);
+		case 25: return ut_new_double(half(take_be(s, 2)), s->mm);
+		case 26: return ut_new_double(bits_float(take_be(s, 4)), s->mm);
+		case 27: return ut_new_double(bits_double(take_be(s, 8)), s->mm);
+		default:
+			s->error = "Unsupported CBOR simple value";
+			return NULL;
+	}
+
+	if (info < 24)        val = info;
+	else if (info == 24)  val = take_be(s, 1);
+	else if (info == 25)  val = take_be(s, 2);
+	else if (info == 26)  val = take_be(s, 4);
+	else if (info == 27)  val = take_be(s, 8);
+	else if (info == 31 && (major == 4 || major == 5)) indef = true;
+	else {
+		s->error = "Unsupported CBOR length";
+		return NULL;
+	}
+
+	if (s->error)
+		return NULL;
+
+	switch (major) {
+		case 0: return new_uint(s, val);
+		case 1: return (val <= INT64_MAX) ? new_int(s, -1 - (int64_t) val) :
+		               ut_new_double(-1.0 - (double) val, s->mm);
+
+		case 2:
+		case 3:
+			str = take_str(s, val);
+			return str ? ut_new_char(str, s->mm) : NULL;
+
+		case 4:
+			tl = tlist_create(NULL, s->mm);
+			for (; indef || val > 0; val--) {
+				if (!(v = cbor_parse(s, depth + 1)))
+					return NULL;
+				if (v == BREAK && indef)
+					break;
+				if (v == BREAK) {
+					s->error = "Unexpected break code";
+					return NULL;
+				}
+
+				tlist_push(tl, v);
+			}
+			return ut_new_tlist(tl, s->mm);
+
+		case 5:
+			th = thash_create_strkey(NULL, s->mm);
+			for (; indef || val > 0; val--) {
+				if (!(k = cbor_parse(s, depth + 1)))
+					return NULL;
+				if (k == BREAK && indef)
+					break;
+				if (k == BREAK) {
+					s->error = "Unexpected break code";
+					return NULL;
+				}
+
+				if (ut_type(k) != T_STRING) {
+					s->error = "Hash key must be a string";
+					return NULL;
+				}
+
+				if (!(v = cbor_parse(s, depth + 1)) || v == BREAK) {
+					s->error = "Missing hash value";
+					return NULL;
+				}
+
+				thash_set(th, ut_char(k), v);
+			}
+			return ut_new_thash(th, s->mm);
+
+		case 6: /* ignore tags */
+			if ((v = cbor_parse(s, depth + 1)) == BREAK) {
+				s->error = "Unexpected break code";
+				return NULL;
+			}
+			return v;
+	}
+
+	return NULL;
+}
+
+/***************************************************************************************************/
+
+/** Decode one object and convert failures to JSON-RPC parse errors */
+static ut *parse(enum rpc_format fmt, struct src *s)
+{
+	ut *obj;
+
+	obj = (fmt == FMT_CBOR) ? cbor_parse(s, 0) : mp_parse(s, 0);
+
+	if (obj == BREAK) {
+		obj = NULL;
+		s->error = "Unexpected break code";
+	}
+
+	if (!obj || s->error)
+		return ut_new_err(JSON_RPC_PARSE_ERROR, "Parse error", s->error, s->mm);
+
+	return obj;
+}
+
+ut *binary_parse(enum rpc_format fmt, const char *buf, size_t len, void *mm)
+{
+	struct src s = { (const unsigned char *) buf, (const unsigned char *) buf + len, NULL, mm, NULL };
+
+	return parse(fmt, &s);
+}
+
+ut *binary_read(enum rpc_format fmt, FILE *fp, void *mm)
+{
+	struct src s = { NULL, NULL, fp, mm, NULL };
+	int c;
+
+	/* clean eof between messages */
+	if ((c = getc(fp)) == EOF)
+		return NULL;
+	ungetc(c, fp);
+
+	return parse(fmt, &s);
+}
+
+xstr *binary_print(enum rpc_format fmt, ut *obj, void *mm)
+{
+	xstr *xs = xstr_create("", mm);
+
+	if (fmt == FMT_CBOR)
+		cbor_print(xs, obj);
+	else
+		mp_print(xs, obj);
+
+	return xs;
+}
+
+const char *binary_mime(enum rpc_format fmt)
+{
+	switch (fmt) {
+		case FMT_MSGPACK: return "application/msgpack";
+		case FMT_CBOR:    return "application/cbor";
+		case FMT_JSON:    break;
+	}
+
+	return "application/json-rpc";
+}
+
+/* for Vim autocompletion:
+ * vim: path=.,/usr/include,/usr/local/include,~/local/include
+ */
@@ -0,0 +1,28 @@
+/*
+ * MessagePack and CBOR encoding of unitype objects
+ *
+ * Copyright (C) 2009-2010 Pawel Foremski <pawel@foremski.pl>
+ *
+ * Licensed under GPLv3
+ */
+
+#ifndef _BINARY_H_
+#define _BINARY_H_
+
+/** Decode object from memory buffer
+ * @param fmt     FMT_MSGPACK or FMT_CBOR
+ * @return        decoded object or ut_err with JSON_RPC_PARSE_ERROR */
+ut *binary_parse(enum rpc_format fmt, const char *buf, size_t len, void *mm);
+
+/** Decode one object from stream, reading exactly as many bytes as needed
+ * @retval NULL   end of file */
+ut *binary_read(enum rpc_format fmt, FILE *fp, void *mm);
+
+/** Encode object
+ * @return        buffer with encoded data, use xstr_length() to get its size */
+xstr *binary_print(enum rpc_format fmt, ut *obj, void *mm);
+
+/** Get MIME type of given format */
+const char *binary_mime(enum rpc_format fmt);
+
+#endif
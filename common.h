@@ -10,9 +10,19 @@
 #include "rpcd.h"
 #include "rpcd_module.h"
 #include "daemon.h"
+#include "ws.h"
 #include "read.h"
 #include "write.h"
 #include "auth.h"
 #include "generic.h"
+#include "shm.h"
+#include "binary.h"
+#include "fastjson.h"
+#include "limit.h"
+#include "prio.h"
+#include "js.h"
+#include "alog.h"
+#include "timing.h"
+#include "record.h"
 
 #endif
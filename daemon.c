@@ -11,13 +11,41 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netdb.h>
 #include <libpjf/lib.h>
 #include "common.h"
 
 __USE_LIBASN
 
+#define DEFER_MAX 1024                /** max number of deferred notifications */
+
+/** Notifications of modules with the "deferred" option, handled when there is nothing else to do */
+static struct {
+	struct rpcd *rpcd;
+	struct req *reqs[DEFER_MAX];       /** the queue */
+	int head;                          /** first request in queue */
+	int count;                         /** number of requests in queue */
+	bool drop;                         /** if true, drop the queue on exit */
+} D;
+
 /** SIGTERM/INT handler */
-static void finish() { unlink(O.pidfile); exit(0); }
+static void finish() { D.drop = true; unlink(O.pidfile); exit(0); }
+
+/** SIGALRM handler: client kept the connection idle for too long, see readhttp()
+ * Installed without SA_RESTART just to break the read, which then exits like on EOF - so that
+ * atexit() handlers still run deferred notifications and flush the access log. */
+static void idle() { }
+
+/** Microseconds since some point in the past */
+static long long usnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
 
 /** Prints usage help screen */
 static void help(void)
@@ -29,10 +57,24 @@ static void help(void)
 	printf("Options:\n");
 	printf("  --json                 read/write in JSON-RPC (default)\n");
 	printf("  --rfc822               read/write in RFC822\n");
+	printf("  --msgpack              read/write in JSON-RPC encoded as MessagePack\n");
+	printf("  --cbor                 read/write in JSON-RPC encoded as CBOR\n");
+	printf("  --fastjson             use built-in SIMD JSON parser where possible\n");
+	printf("  --snapshot=<path>      keep parsed config in <path>, reuse while config file is unchanged\n");
+	printf("  --access-log=<path>    log each request to <path>, reopen on SIGUSR1\n");
+	printf("  --timing=<rate>        time phases of given fraction of requests, eg. 0.01 [0]\n");
+	printf("  --timing-reply         report phase timing of sampled requests to the client\n");
+	printf("  --record=<path>        append requests to <path>, for rpcd-replay\n");
+	printf("  --record-redact=<list> hide given params in capture, \"http.pass\" hides credentials\n");
 	printf("\n");
 	printf("  --http                 read/write in JSON-RPC over HTTP\n");
 	printf("  --htpasswd=<file>      require HTTP authentication from file (plain passwords)\n");
 	printf("  --htdocs=<dir>         serve static HTTP docs from given dir\n");
+	printf("  --keepalive-idle=<s>   close connection idle for <s> seconds, 0 means never [%d]\n",
+		RPCD_DEFAULT_KEEPALIVE_IDLE);
+	printf("  --keepalive-max=<n>    close connection after <n> requests, 0 means never [%d]\n",
+		RPCD_DEFAULT_KEEPALIVE_MAX);
+	printf("  --max-conns=<n>        serve at most <n> connections at once, reply 503 to others\n");
 	printf("\n");
 	printf("  --daemonize,-d <name>  daemonize, log to syslog with given <name>\n");
 	printf("  --pidfile=<path>       where to write daemon PID to [%s]\n", RPCD_DEFAULT_PIDFILE);
@@ -75,6 +117,18 @@ static int parse_argv(int argc, char *argv[])
 		{ "name",       1, NULL, 10  },
 		{ "htpasswd",   1, NULL, 11  },
 		{ "htdocs",     1, NULL, 12  },
+		{ "msgpack",    0, NULL, 13  },
+		{ "cbor",       0, NULL, 14  },
+		{ "fastjson",   0, NULL, 15  },
+		{ "snapshot",   1, NULL, 16  },
+		{ "keepalive-idle", 1, NULL, 17 },
+		{ "keepalive-max",  1, NULL, 18 },
+		{ "max-conns",  1, NULL, 19  },
+		{ "access-log", 1, NULL, 20  },
+		{ "timing",     1, NULL, 21  },
+		{ "timing-reply", 0, NULL, 22 },
+		{ "record",     1, NULL, 23  },
+		{ "record-redact", 1, NULL, 24 },
 		{ 0, 0, 0, 0 }
 	};
 
@@ -86,6 +140,9 @@ static int parse_argv(int argc, char *argv[])
 	O.mode = RPCD_JSON;
 	O.read = readjson;
 	O.write = writejson;
+	O.capture = writecapture;
+	O.http.idle = RPCD_DEFAULT_KEEPALIVE_IDLE;
+	O.http.maxreq = RPCD_DEFAULT_KEEPALIVE_MAX;
 
 	for (;;) {
 		c = getopt_long(argc, argv, short_opts, long_opts, &i);
@@ -119,6 +176,23 @@ static int parse_argv(int argc, char *argv[])
 			case 10 : O.name = optarg; break;
 			case 11 : O.http.htpasswd = optarg; break;
 			case 12 : O.http.htdocs = optarg; break;
+			case 13 :
+			case 14 :
+				O.mode = RPCD_BINARY;
+				O.format = (c == 13) ? FMT_MSGPACK : FMT_CBOR;
+				O.read = readbinary;
+				O.write = writebinary;
+				break;
+			case 15 : O.fastjson = true; break;
+			case 16 : O.snapshot = optarg; break;
+			case 17 : O.http.idle = MAX(atoi(optarg), 0); break;
+			case 18 : O.http.maxreq = MAX(atoi(optarg), 0); break;
+			case 19 : O.http.maxconn = MAX(atoi(optarg), 0); break;
+			case 20 : O.accesslog = optarg; break;
+			case 21 : O.timing = atof(optarg); break;
+			case 22 : O.timingreply = true; break;
+			case 23 : O.record = optarg; break;
+			case 24 : O.redact = optarg; break;
 			default: help(); return 0;
 		}
 	}
@@ -133,21 +207,62 @@ static int parse_argv(int argc, char *argv[])
 	return 1;
 }
 
+/** Find network address of client connected on stdin, if any (eg. under inetd)
+ * @retval NULL   not a socket */
+static const char *peer_addr(void)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof ss;
+	char host[NI_MAXHOST];
+
+	if (getpeername(0, (struct sockaddr *) &ss, &len) == -1)
+		return NULL;
+
+	if (getnameinfo((struct sockaddr *) &ss, len, host, sizeof host, NULL, 0, NI_NUMERICHOST) != 0)
+		return NULL;
+
+	return asn_malloc_printf("%s", host);
+}
+
+/** HTTP authentication, done once per request
+ * @retval false   access denied, error set */
+static bool authenticate(struct req *req)
+{
+	if (!req->http.needauth || !O.http.htpasswd)
+		return true;
+
+	req->http.needauth = false;
+	auth_http(req);
+	timing_mark(req, TIMING_AUTH);
+
+	if (!req->user)
+		return errcode(JSON_RPC_ACCESS_DENIED);
+
+	return true;
+}
+
 /** Pass request to librpcd
  * @retval true    request went through modules
  * @retval false   request handled internally - eg. error or HTTP GET */
 bool handle(struct rpcd *rpcd, struct req *req)
 {
-	/* HTTP authentication */
-	if (req->http.needauth && O.http.htpasswd) {
-		auth_http(req);
-		if (!req->user)
-			return errcode(JSON_RPC_ACCESS_DENIED);
-	}
+	if (!authenticate(req))
+		return false;
 
 	if (!ut_ok(req->reply))
 		return false;
 
+	/* GET must be safe to repeat, so only methods declared cacheable can be called this way */
+	if (req->http.get) {
+		struct mod *mod = rpcd_find(rpcd, req->service, req->method);
+		ut *cache = mod ? uth_get(mod->cfg, "cache") : NULL;
+
+		if (!mod)
+			return errcode(JSON_RPC_NOT_FOUND);
+		else if (!cache || !ut_is_thash(cache))
+			return err(JSON_RPC_INVALID_REQUEST, "Method not cacheable", req->method);
+	}
+
 	/*
 	 * Handle RPC call
 	 */
@@ -156,10 +271,119 @@ bool handle(struct rpcd *rpcd, struct req *req)
 	return true;
 }
 
+/** Check if req should be handled later, after reading next requests
+ * Applies to notifications of modules with "deferred = true" in config. */
+static bool deferrable(struct rpcd *rpcd, struct req *req)
+{
+	struct mod *mod;
+
+	if (!req->notify || !ut_ok(req->reply))
+		return false;
+
+	mod = rpcd_find(rpcd, req->service, req->method);
+	if (!mod || !uth_bool(mod->cfg, "deferred"))
+		return false;
+
+	/* the client gets 204 right away, so check who is asking first */
+	return authenticate(req);
+}
+
+/** Copy HTTP headers of req out of the read buffer, which next request overwrites - see headers() */
+static void keep_headers(struct req *req)
+{
+	const char **slots[] = {
+		&req->http.content_type, &req->http.content_length, &req->http.accept,
+		&req->http.authorization, &req->http.connection, &req->http.if_modified_since,
+		&req->http.if_none_match, &req->http.qooxdoo, &req->http.upgrade,
+		&req->http.ws_key, &req->http.ws_version,
+	};
+	const char *old = req->http.head, *end = old;
+	char *copy;
+	int i;
+
+	if (!old)
+		return;
+
+	for (i = 0; i < 2 * req->http.count; i++)
+		end += strlen(end) + 1;
+
+	copy = mmatic_alloc(end - old + 1, req);
+	memcpy(copy, old, end - old);
+	req->http.head = copy;
+
+	for (i = 0; i < sizeof slots / sizeof slots[0]; i++) {
+		if (*slots[i] >= old && *slots[i] < end)
+			*slots[i] = copy + (*slots[i] - old);
+	}
+}
+
+/** Handle deferred notifications
+ * @param all     if false, stop as soon as next request is waiting on input */
+static void drain(bool all)
+{
+	struct req *req;
+	long long start;
+
+	while (D.count > 0) {
+		if (!all && read_pending())
+			break;
+
+		req = D.reqs[D.head];
+		D.head = (D.head + 1) % DEFER_MAX;
+		D.count--;
+
+		start = usnow();
+		handle(D.rpcd, req);
+		alog_add(req, usnow() - start);
+
+		/* eg. handler timed out, see call() in rpcd.c - do not run anything else */
+		if (req->last) {
+			D.count = 0;
+
+			if (!D.drop) {
+				D.drop = true;
+				exit(0);
+			}
+		}
+
+		mmatic_free(req);
+	}
+}
+
+/** Do not lose deferred notifications on EOF - readers just exit() */
+static void drain_exit(void)
+{
+	if (D.drop)
+		return;
+
+	/* no exit() from here */
+	D.drop = true;
+	drain(true);
+}
+
+/** Queue req for drain() */
+static void defer(struct req *req)
+{
+	if (D.count == DEFER_MAX)
+		drain(true);
+
+	/* phases would not add up */
+	req->timing = NULL;
+	keep_headers(req);
+
+	D.reqs[(D.head + D.count) % DEFER_MAX] = req;
+	D.count++;
+}
+
 int main(int argc, char *argv[])
 {
 	struct rpcd *rpcd;
 	struct req *req = NULL;
+	struct limit *conns = NULL;
+	const char *addr;
+	bool counted = false, last;
+	long long start;
+	struct sigaction sa;
 
 	signal(SIGTERM, finish);
 	signal(SIGINT,  finish);
@@ -172,7 +396,7 @@ int main(int argc, char *argv[])
 	if (asn_isdir(O.config_file) == 1) {
 		rpcd = rpcd_init(asn_malloc_printf("\"%s\" = {}", O.config_file), true);
 	} else {
-		rpcd = rpcd_init(O.config_file, false);
+		rpcd = rpcd_init_snapshot(O.config_file, false, O.snapshot);
 	}
 
 	if (!rpcd) {
@@ -183,21 +407,84 @@ int main(int argc, char *argv[])
 	if (O.daemonize)
 		asn_daemonize(O.name, O.pidfile);
 
+	addr = peer_addr();
+
+	if (O.accesslog && !alog_init(O.accesslog))
+		return 3;
+
+	if (O.record && !record_init(O.record, O.redact))
+		return 3;
+
+	if (O.mode == RPCD_HTTP) {
+		memset(&sa, 0, sizeof sa);
+		sa.sa_handler = idle;
+		sigaction(SIGALRM, &sa, NULL);
+
+		conns = limit_connections(O.config_file, O.http.maxconn, rpcd);
+	}
+
+	D.rpcd = rpcd;
+	atexit(drain_exit);
+
 	do {
 		/* flush temp mem */
 		if (req)
 			mmatic_free(req);
 
+		/* use spare time for deferred notifications */
+		drain(false);
+
 		/* prepare request struct */
 		req = mmatic_zalloc(sizeof *req, mmatic_create());
 		req->prv = ut_new_thash(NULL, req);
 		req->reply = ut_new_thash(NULL, req);
+		req->addr = addr;
+		timing_sample(req, O.timing);
 
 		/* handle it */
 		O.read(req);
+		start = usnow();
+		timing_mark(req, TIMING_READ);
+		record_add(req);
+
+		if (O.mode == RPCD_HTTP) {
+			/* the slot is given back by the kernel on exit, see limit.c */
+			if (!counted) {
+				if (limit_enter(req, conns))
+					counted = true;
+				else
+					req->last = true;
+			}
+
+			if (O.http.maxreq > 0 && O.http.requests >= O.http.maxreq)
+				req->last = true;
+		}
+
+		last = req->last;
+
+		if (deferrable(rpcd, req)) {
+			/* HTTP needs a status line, see writehttp() */
+			if (O.mode == RPCD_HTTP)
+				O.write(req);
+
+			defer(req);
+			req = NULL;
+			continue;
+		}
+
 		handle(rpcd, req);
-		O.write(req);
-	} while (req->last == false);
+
+		/* skip serializing a reply nobody waits for */
+		if (!req->notify || O.mode == RPCD_HTTP)
+			O.write(req);
+
+		timing_mark(req, TIMING_WRITE);
+		alog_add(req, usnow() - start);
+		timing_done(rpcd, req);
+
+		rpcd_unload_idle(rpcd);
+		last = req->last;
+	} while (last == false);
 
 	return 0;
 }
@@ -21,19 +21,39 @@ struct rpcd_opts {
 	enum rpcd_mode {
 		RPCD_JSON = 1,
 		RPCD_RFC,
-		RPCD_HTTP
+		RPCD_HTTP,
+		RPCD_BINARY,
+		RPCD_WEBSOCKET              /** RPCD_HTTP connection after WebSocket upgrade */
 	} mode;                     /** mode of operation */
 
+	enum rpc_format format;     /** format used in RPCD_BINARY mode */
+	bool fastjson;              /** if true, try the built-in JSON parser first */
+	const char *snapshot;       /** if not NULL, path to config snapshot */
+	const char *accesslog;      /** if not NULL, path to access log */
+	double timing;              /** fraction of requests to time, see timing.h */
+	bool timingreply;           /** if true, report phase timing in replies */
+	const char *record;         /** if not NULL, path to traffic capture */
+	const char *redact;         /** params to hide in capture, see record_init() */
+
 	/** Pointer at function reading new request */
 	bool (*read)(struct req *req);
 
 	/** Pointer at function writing reply */
 	void (*write)(struct req *req);
 
+	/** Pointer at function serializing reply as write() would, see writecapture() */
+	const char *(*capture)(struct req *req, size_t *len);
+
 	/* HTTP options */
 	struct rpcd_http_data {
 		const char *htdocs;         /** serve static HTTP files from here */
 		const char *htpasswd;       /** HTTP passwd file */
+		int idle;                   /** keep-alive: max seconds to wait for next request, 0 means forever */
+		int maxreq;                 /** keep-alive: max requests per connection, 0 means no limit */
+		int maxconn;                /** max connections served at once, 0 means no limit */
+		int requests;               /** requests read on this connection so far */
+		const char *user;           /** WebSocket: user authenticated on upgrade */
+		const char *pass;           /** WebSocket: and his password */
 	} http;
 } O;
 
@@ -0,0 +1,311 @@
+/*
+ * Differential test and benchmark of fastjson.c against libpjf
+ *
+ * Every scanner available on this CPU (scalar, SSE2, AVX2) is run on the same corpus: all byte
+ * values at all offsets, control characters and invalid UTF-8 inside strings, truncated and
+ * malformed documents. The scanners must agree with each other, and whenever fastjson_parse()
+ * does not give up, json_print() of its result must equal that of json_parse().
+ *
+ * Usage: fastjson-test [--bench]
+ *
+ * Copyright (C) 2009-2010 Pawel Foremski <pawel@foremski.pl>
+ *
+ * Licensed under GPLv3
+ */
+
+#include <time.h>
+#include "fastjson.c"
+
+__USE_LIBASN
+
+#define BENCH_BYTES (4 << 20)          /** size of benchmark document */
+
+struct impl {
+	const char *name;
+	size_t (*fn)(const char *p, size_t len);
+};
+
+static struct impl impls[3];
+static int nimpls;
+static int failures;
+
+static void fail(const char *what, const char *doc, size_t len)
+{
+	size_t i;
+
+	failures++;
+	fprintf(stderr, "FAIL %s: ", what);
+	for (i = 0; i < len && i < 80; i++)
+		fprintf(stderr, (doc[i] >= 0x20 && doc[i] < 0x7f) ? "%c" : "\\x%02x", (unsigned char) doc[i]);
+	fprintf(stderr, "\n");
+}
+
+static void impls_init(void)
+{
+	impls[nimpls++] = (struct impl) { "scalar", scan_scalar };
+
+#ifdef FJ_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse2"))
+		impls[nimpls++] = (struct impl) { "SSE2", scan_sse2 };
+	if (__builtin_cpu_supports("avx2"))
+		impls[nimpls++] = (struct impl) { "AVX2", scan_avx2 };
+#endif
+}
+
+/** All scanners must stop at the same byte */
+static void test_scan(void)
+{
+	char buf[160];
+	size_t len, pos, r0, r;
+	int b, i, align;
+
+	for (align = 0; align < 4; align++) {
+		for (len = 0; len < 100; len++) {
+			for (pos = 0; pos < len; pos++) {
+				for (b = 0; b < 256; b++) {
+					memset(buf, 'a', sizeof buf);
+					buf[align + pos] = b;
+
+					r0 = impls[0].fn(buf + align, len);
+					for (i = 1; i < nimpls; i++) {
+						r = impls[i].fn(buf + align, len);
+						if (r != r0) {
+							fprintf(stderr, "%s: byte 0x%02x at %zu of %zu: %zu, scalar: %zu\n",
+								impls[i].name, b, pos, len, r, r0);
+							fail("scan", buf + align, len);
+						}
+					}
+
+					if (special(b) ? r0 != pos : r0 != len)
+						fail("scan scalar", buf + align, len);
+				}
+			}
+		}
+	}
+}
+
+/** Parse doc with every scanner and compare with libpjf */
+static void test_doc(const char *doc, size_t len)
+{
+	void *mm = mmatic_create();
+	char *txt, *ref = NULL, *got, *first = NULL;
+	struct lazy *lz;
+	bool indexed = false;
+	ut *r;
+	int i;
+
+	/* json_parse() needs \0 */
+	txt = mmatic_alloc(len + 1, mm);
+	memcpy(txt, doc, len);
+	txt[len] = '\0';
+
+	for (i = 0; i < nimpls; i++) {
+		scan = impls[i].fn;
+
+		r = fastjson_parse(txt, len, mm);
+		got = r ? json_print(json_create(mm), r) : "(gave up)";
+
+		if (i == 0) {
+			first = got;
+		} else if (!streq(got, first)) {
+			fprintf(stderr, "%s: %s, scalar: %s\n", impls[i].name, got, first);
+			fail("scanners disagree", doc, len);
+		}
+
+		if (r) {
+			if (!ref) {
+				r = json_parse(json_create(mm), txt);
+				ref = (r && ut_ok(r)) ? json_print(json_create(mm), r) : "(error)";
+			}
+
+			if (!streq(got, ref)) {
+				fprintf(stderr, "fastjson: %s, libpjf: %s\n", got, ref);
+				fail(impls[i].name, doc, len);
+			}
+		}
+
+		/* must not crash nor disagree */
+		lz = fastjson_lazy(txt, len, mm);
+		if (i == 0)
+			indexed = fastjson_lazy_index(lz);
+		else if (fastjson_lazy_index(lz) != indexed)
+			fail("lazy index", doc, len);
+	}
+
+	mmatic_free(mm);
+}
+
+static void test_str(const char *doc)
+{
+	test_doc(doc, strlen(doc));
+}
+
+static void test_parse(void)
+{
+	static const char *utf8s[] = {
+		/* valid */
+		"\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\xef\xbf\xbf", "\xf4\x8f\xbf\xbf",
+		/* overlong, surrogates, out of range, truncated, stray */
+		"\xc0\xaf", "\xc1\xbf", "\xe0\x80\xaf", "\xe0\x9f\xbf", "\xf0\x80\x80\xaf",
+		"\xed\xa0\x80", "\xed\xbf\xbf", "\xf4\x90\x80\x80", "\xf5\x80\x80\x80",
+		"\xf8\x88\x80\x80\x80", "\xfe", "\xff", "\x80", "\xbf", "\xc3", "\xe2\x82",
+		"\xf0\x9f\x98", "\xc3\x28", "\xe2\x28\xa1",
+	};
+	static const char *docs[] = {
+		"{}", "[]", "\"\"", "0", "-0", "1.5", "-1e10", "1E+2", "2147483647", "2147483648",
+		"-2147483649", "01", "1.", ".5", "+1", "true", "false", "null", "tru", "nul",
+		"{\"a\":1,\"b\":[1,2,{\"c\":null}],\"d\":\"e\"}", "[1,]", "{\"a\":}", "{\"a\" 1}",
+		"[\"\\n\\t\\\\\\/\\\"\"]", "\"\\u0041\"", "\"\\x\"", "\"\\", "{\"params\":\"\\",
+		"\"abc", "[1", "{\"a\":1", " [ 1 , 2 ] ", "[1] x", "\"\\\\\"",
+	};
+	char doc[256], pad[64];
+	size_t i, n;
+	int b;
+
+	for (i = 0; i < sizeof docs / sizeof docs[0]; i++)
+		test_str(docs[i]);
+
+	/* every byte inside a string, at offsets hitting scalar tails and SIMD blocks */
+	for (b = 0; b < 256; b++) {
+		for (n = 0; n < 48; n++) {
+			memset(pad, 'a', n);
+			pad[n] = '\0';
+
+			i = snprintf(doc, sizeof doc, "{\"k\":\"%s", pad);
+			doc[i++] = b;
+			i += snprintf(doc + i, sizeof doc - i, "z\"}");
+			test_doc(doc, i);
+
+			/* as key, and truncated right after */
+			i = snprintf(doc, sizeof doc, "{\"%s", pad);
+			doc[i++] = b;
+			test_doc(doc, i);
+			i += snprintf(doc + i, sizeof doc - i, "\":1}");
+			test_doc(doc, i);
+		}
+	}
+
+	/* UTF-8 sequences, valid and not */
+	for (i = 0; i < sizeof utf8s / sizeof utf8s[0]; i++) {
+		for (n = 0; n < 40; n += 13) {
+			memset(pad, 'a', n);
+			pad[n] = '\0';
+
+			snprintf(doc, sizeof doc, "[\"%s%s\"]", pad, utf8s[i]);
+			test_str(doc);
+			snprintf(doc, sizeof doc, "[\"%s%s", pad, utf8s[i]);
+			test_str(doc);
+		}
+	}
+}
+
+/** Make a document resembling typical requests */
+static char *bench_doc(size_t *len)
+{
+	char *doc = malloc(BENCH_BYTES + 256);
+	size_t l = 0;
+	int i = 0;
+
+	l += sprintf(doc, "[");
+	while (l < BENCH_BYTES) {
+		l += sprintf(doc + l, "%s{\"id\":%d,\"name\":\"user%d\",\"email\":\"user%d@example.com\","
+			"\"note\":\"Lorem ipsum dolor sit amet, consectetur \\\"adipiscing\\\" elit\","
+			"\"score\":%d.%d,\"active\":%s,\"tags\":[\"a\",\"b\",\"c\"]}",
+			i ? "," : "", i, i, i, i % 1000, i % 10, (i % 2) ? "true" : "false");
+		i++;
+	}
+	l += sprintf(doc + l, "]");
+
+	*len = l;
+	return doc;
+}
+
+static double secs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(void)
+{
+	size_t len, i;
+	char *doc = bench_doc(&len);
+	void *mm;
+	double t, mb = len / 1e6;
+	int k, rounds = 10;
+	ut *r;
+
+	printf("document: %.1f MB, %d rounds\n", mb, rounds);
+
+	for (k = 0; k < nimpls; k++) {
+		scan = impls[k].fn;
+
+		t = secs();
+		for (i = 0; i < rounds; i++) {
+			mm = mmatic_create();
+			if (!fastjson_parse(doc, len, mm))
+				fail("bench document", doc, len);
+			mmatic_free(mm);
+		}
+		t = secs() - t;
+
+		printf("fastjson_parse (%s):%*s %8.1f MB/s\n", impls[k].name,
+			(int) (6 - strlen(impls[k].name)), "", mb * rounds / t);
+	}
+
+	t = secs();
+	for (i = 0; i < rounds; i++) {
+		mm = mmatic_create();
+		json_parse(json_create(mm), doc);
+		mmatic_free(mm);
+	}
+	t = secs() - t;
+	printf("json_parse:              %8.1f MB/s\n", mb * rounds / t);
+
+	/* for reference: the other half of a request's JSON cost */
+	mm = mmatic_create();
+	r = json_parse(json_create(mm), doc);
+	t = secs();
+	for (i = 0; i < rounds; i++)
+		json_print(json_create(mm), r);
+	t = secs() - t;
+	printf("json_print:              %8.1f MB/s\n", mb * rounds / t);
+	mmatic_free(mm);
+
+	free(doc);
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+
+	impls_init();
+
+	printf("scanners:");
+	for (i = 0; i < nimpls; i++)
+		printf(" %s", impls[i].name);
+	printf("\n");
+
+	test_scan();
+	test_parse();
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+
+	printf("all tests passed\n");
+
+	if (argc > 1 && streq(argv[1], "--bench"))
+		bench();
+
+	return 0;
+}
+
+/* for Vim autocompletion:
+ * vim: path=.,/usr/include,/usr/local/include,~/local/include
+ */
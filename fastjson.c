@@ -0,0 +1,628 @@
+/*
+ * Fast path JSON parser, using SSE2/AVX2 when available
+ *
+ * Produces the same unitype tree as json_parse() from libpjf. Anything this parser is not sure
+ * to handle identically (\u escapes, integers not fitting in int, invalid UTF-8, syntax errors)
+ * makes it give up, so the caller can fall back to json_parse() and get the very same result
+ * and error messages.
+ *
+ * Copyright (C) 2009-2010 Pawel Foremski <pawel@foremski.pl>
+ *
+ * Licensed under GPLv3
+ */
+
+#include <limits.h>
+#include "common.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FJ_X86 1
+#include <immintrin.h>
+#endif
+
+#define MAX_DEPTH 512                  /** max nesting of lists and hashes */
+
+struct fj {
+	const char *p;                     /** current position */
+	const char *end;                   /** end of input */
+	void *mm;                          /** where to allocate objects */
+};
+
+/***************************************************************************************************/
+/* Structural character scanning */
+
+/** Return true for bytes that end a plain run of string characters */
+static inline bool special(unsigned char c)
+{
+	return c == '"' || c == '\\' || c < 0x20 || c >= 0x80;
+}
+
+static size_t scan_scalar(const char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (special(p[i]))
+			break;
+	}
+
+	return i;
+}
+
+#ifdef FJ_X86
+__attribute__((target("sse2")))
+static size_t scan_sse2(const char *p, size_t len)
+{
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i bslash = _mm_set1_epi8('\\');
+	const __m128i space = _mm_set1_epi8(0x20);
+	__m128i v, m;
+	int mask;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (p + i));
+
+		/* signed compare catches both control chars and bytes >= 0x80 */
+		m = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)),
+			_mm_cmplt_epi8(v, space));
+
+		if ((mask = _mm_movemask_epi8(m)))
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + scan_scalar(p + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *p, size_t len)
+{
+	const __m256i quote = _mm256_set1_epi8('"');
+	const __m256i bslash = _mm256_set1_epi8('\\');
+	const __m256i space = _mm256_set1_epi8(0x20);
+	__m256i v, m;
+	unsigned int mask;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *) (p + i));
+
+		/* no signed less-than in AVX2: 0x20 > v catches control chars and bytes >= 0x80 */
+		m = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, bslash)),
+			_mm256_cmpgt_epi8(space, v));
+
+		if ((mask = _mm256_movemask_epi8(m)))
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + scan_sse2(p + i, len - i);
+}
+#endif
+
+/** Chosen on first use, depending on CPU */
+static size_t (*scan)(const char *p, size_t len) = NULL;
+
+static void scan_init(void)
+{
+	scan = scan_scalar;
+
+#ifdef FJ_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		scan = scan_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		scan = scan_sse2;
+#endif
+
+	dbg(5, "using %s scanner\n",
+		scan == scan_scalar ? "scalar" : (scan == scan_sse2 ? "SSE2" : "AVX2"));
+}
+
+size_t fastjson_scan(const char *p, size_t len)
+{
+	if (!scan)
+		scan_init();
+
+	return scan(p, len);
+}
+
+/***************************************************************************************************/
+/* UTF-8 validation */
+
+/** Validate one multi-byte UTF-8 sequence
+ * @return length of the sequence
+ * @retval 0   invalid sequence */
+static int utf8(const unsigned char *p, const unsigned char *end)
+{
+	int n, i;
+	uint32_t cp;
+
+	if (p[0] >= 0xc2 && p[0] <= 0xdf)      { n = 2; cp = p[0] & 0x1f; }
+	else if (p[0] >= 0xe0 && p[0] <= 0xef) { n = 3; cp = p[0] & 0x0f; }
+	else if (p[0] >= 0xf0 && p[0] <= 0xf4) { n = 4; cp = p[0] & 0x07; }
+	else return 0;
+
+	if (end - p < n)
+		return 0;
+
+	for (i = 1; i < n; i++) {
+		if ((p[i] & 0xc0) != 0x80)
+			return 0;
+
+		cp = (cp << 6) | (p[i] & 0x3f);
+	}
+
+	/* overlong forms, surrogates and out of range */
+	if ((n == 3 && cp < 0x800) || (n == 4 && cp < 0x10000) ||
+	    (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff)
+		return 0;
+
+	return n;
+}
+
+/***************************************************************************************************/
+/* Parser */
+
+static ut *value(struct fj *fj, int depth);
+
+static inline void ws(struct fj *fj)
+{
+	while (fj->p < fj->end &&
+		(*fj->p == ' ' || *fj->p == '\n' || *fj->p == '\r' || *fj->p == '\t'))
+		fj->p++;
+}
+
+/** Parse string, fj->p pointing after the opening quote
+ * @retval NULL   give up */
+static char *string(struct fj *fj)
+{
+	const char *start = fj->p, *p = fj->p;
+	char *out, *o;
+	bool escaped = false;
+	int n;
+
+	/* pass 1: find the end, validate */
+	for (;;) {
+		p += scan(p, fj->end - p);
+		if (p >= fj->end)
+			return NULL;
+
+		if (*p == '"') {
+			break;
+		} else if (*p == '\\') {
+			if (p + 1 >= fj->end || p[1] == 'u')
+				return NULL;
+
+			escaped = true;
+			p += 2;
+		} else if ((unsigned char) *p >= 0x80) {
+			if (!(n = utf8((const unsigned char *) p, (const unsigned char *) fj->end)))
+				return NULL;
+
+			p += n;
+		} else {
+			return NULL; /* control char */
+		}
+	}
+
+	fj->p = p + 1;
+	out = mmatic_alloc(p - start + 1, fj->mm);
+
+	if (!escaped) {
+		memcpy(out, start, p - start);
+		out[p - start] = '\0';
+		return out;
+	}
+
+	/* pass 2: unescape */
+	for (o = out; start < p; start++) {
+		if (*start != '\\') {
+			*o++ = *start;
+			continue;
+		}
+
+		switch (*++start) {
+			case '"':  *o++ = '"';  break;
+			case '\\': *o++ = '\\'; break;
+			case '/':  *o++ = '/';  break;
+			case 'b':  *o++ = '\b'; break;
+			case 'f':  *o++ = '\f'; break;
+			case 'n':  *o++ = '\n'; break;
+			case 'r':  *o++ = '\r'; break;
+			case 't':  *o++ = '\t'; break;
+			default:   return NULL;
+		}
+	}
+
+	*o = '\0';
+	return out;
+}
+
+static ut *number(struct fj *fj)
+{
+	const char *p = fj->p;
+	bool real = false;
+	char buf[64], *endp;
+	long l;
+
+	if (p < fj->end && *p == '-') p++;
+
+	if (p < fj->end && *p == '0') {
+		p++;
+	} else if (p < fj->end && *p >= '1' && *p <= '9') {
+		while (p < fj->end && *p >= '0' && *p <= '9') p++;
+	} else return NULL;
+
+	if (p < fj->end && *p == '.') {
+		real = true;
+		if (++p >= fj->end || *p < '0' || *p > '9') return NULL;
+		while (p < fj->end && *p >= '0' && *p <= '9') p++;
+	}
+
+	if (p < fj->end && (*p == 'e' || *p == 'E')) {
+		real = true;
+		p++;
+		if (p < fj->end && (*p == '+' || *p == '-')) p++;
+		if (p >= fj->end || *p < '0' || *p > '9') return NULL;
+		while (p < fj->end && *p >= '0' && *p <= '9') p++;
+	}
+
+	/* input need not be terminated right after the number */
+	if (p - fj->p >= sizeof buf)
+		return NULL;
+
+	memcpy(buf, fj->p, p - fj->p);
+	buf[p - fj->p] = '\0';
+	fj->p = p;
+
+	if (real)
+		return ut_new_double(strtod(buf, NULL), fj->mm);
+
+	errno = 0;
+	l = strtol(buf, &endp, 10);
+	if (errno || l < INT_MIN || l > INT_MAX)
+		return NULL;
+
+	return ut_new_int(l, fj->mm);
+}
+
+static bool literal(struct fj *fj, const char *lit)
+{
+	size_t len = strlen(lit);
+
+	if (fj->end - fj->p < len || memcmp(fj->p, lit, len) != 0)
+		return false;
+
+	fj->p += len;
+	return true;
+}
+
+static ut *list(struct fj *fj, int depth)
+{
+	tlist *tl = tlist_create(NULL, fj->mm);
+	ut *v;
+
+	ws(fj);
+	if (fj->p < fj->end && *fj->p == ']') {
+		fj->p++;
+		return ut_new_tlist(tl, fj->mm);
+	}
+
+	for (;;) {
+		if (!(v = value(fj, depth + 1)))
+			return NULL;
+
+		tlist_push(tl, v);
+
+		ws(fj);
+		if (fj->p >= fj->end)
+			return NULL;
+
+		if (*fj->p == ',') {
+			fj->p++;
+		} else if (*fj->p == ']') {
+			fj->p++;
+			return ut_new_tlist(tl, fj->mm);
+		} else return NULL;
+	}
+}
+
+static ut *hash(struct fj *fj, int depth)
+{
+	thash *th = thash_create_strkey(NULL, fj->mm);
+	char *k;
+	ut *v;
+
+	ws(fj);
+	if (fj->p < fj->end && *fj->p == '}') {
+		fj->p++;
+		return ut_new_thash(th, fj->mm);
+	}
+
+	for (;;) {
+		ws(fj);
+		if (fj->p >= fj->end || *fj->p++ != '"')
+			return NULL;
+
+		if (!(k = string(fj)))
+			return NULL;
+
+		ws(fj);
+		if (fj->p >= fj->end || *fj->p++ != ':')
+			return NULL;
+
+		if (!(v = value(fj, depth + 1)))
+			return NULL;
+
+		thash_set(th, k, v);
+
+		ws(fj);
+		if (fj->p >= fj->end)
+			return NULL;
+
+		if (*fj->p == ',') {
+			fj->p++;
+		} else if (*fj->p == '}') {
+			fj->p++;
+			return ut_new_thash(th, fj->mm);
+		} else return NULL;
+	}
+}
+
+static ut *value(struct fj *fj, int depth)
+{
+	char *str;
+
+	if (depth > MAX_DEPTH)
+		return NULL;
+
+	ws(fj);
+	if (fj->p >= fj->end)
+		return NULL;
+
+	switch (*fj->p) {
+		case '{':
+			fj->p++;
+			return hash(fj, depth);
+		case '[':
+			fj->p++;
+			return list(fj, depth);
+		case '"':
+			fj->p++;
+			str = string(fj);
+			return str ? ut_new_char(str, fj->mm) : NULL;
+		case 't':
+			return literal(fj, "true") ? ut_new_bool(true, fj->mm) : NULL;
+		case 'f':
+			return literal(fj, "false") ? ut_new_bool(false, fj->mm) : NULL;
+		case 'n':
+			return literal(fj, "null") ? ut_new_null(fj->mm) : NULL;
+		default:
+			return number(fj);
+	}
+}
+
+ut *fastjson_parse(const char *txt, size_t len, void *mm)
+{
+	struct fj fj = { txt, txt + len, mm };
+	ut *obj;
+
+	if (!scan)
+		scan_init();
+
+	obj = value(&fj, 0);
+	if (!obj)
+		return NULL;
+
+	/* trailing garbage */
+	ws(&fj);
+	if (fj.p != fj.end)
+		return NULL;
+
+	return obj;
+}
+
+/***************************************************************************************************/
+/* Lazy parsing */
+
+/** Skip string contents, fj->p pointing after the opening quote */
+static bool skip_string(struct fj *fj)
+{
+	for (;;) {
+		fj->p += scan(fj->p, fj->end - fj->p);
+		if (fj->p >= fj->end)
+			return false;
+
+		switch (*fj->p) {
+			case '"':
+				fj->p++;
+				return true;
+
+			case '\\':
+				/* body may end right after the backslash */
+				if (fj->p + 1 >= fj->end)
+					return false;
+				fj->p += 2;
+				break;
+
+			default:
+				fj->p++;
+				break;
+		}
+	}
+}
+
+/** Skip a value without parsing it - only the structure is checked */
+static bool skip(struct fj *fj, int depth)
+{
+	const char *start;
+	char close;
+
+	if (depth > MAX_DEPTH)
+		return false;
+
+	ws(fj);
+	if (fj->p >= fj->end)
+		return false;
+
+	switch (*fj->p) {
+		case '"':
+			fj->p++;
+			return skip_string(fj);
+
+		case '{':
+		case '[':
+			close = (*fj->p++ == '{') ? '}' : ']';
+
+			ws(fj);
+			if (fj->p < fj->end && *fj->p == close) {
+				fj->p++;
+				return true;
+			}
+
+			for (;;) {
+				if (close == '}') {
+					ws(fj);
+					if (fj->p >= fj->end || *fj->p++ != '"' || !skip_string(fj))
+						return false;
+
+					ws(fj);
+					if (fj->p >= fj->end || *fj->p++ != ':')
+						return false;
+				}
+
+				if (!skip(fj, depth + 1))
+					return false;
+
+				ws(fj);
+				if (fj->p >= fj->end)
+					return false;
+
+				if (*fj->p == close) {
+					fj->p++;
+					return true;
+				} else if (*fj->p++ != ',') {
+					return false;
+				}
+			}
+
+		default:
+			start = fj->p;
+			while (fj->p < fj->end && !strchr(",]} \t\r\n", *fj->p))
+				fj->p++;
+			return fj->p > start;
+	}
+}
+
+struct lazy *fastjson_lazy(const char *txt, size_t len, void *mm)
+{
+	struct lazy *lz;
+
+	if (!scan)
+		scan_init();
+
+	lz = mmatic_zalloc(sizeof *lz, mm);
+	lz->txt = txt;
+	lz->len = len;
+	lz->mm = mm;
+
+	return lz;
+}
+
+bool fastjson_lazy_index(struct lazy *lz)
+{
+	struct fj fj = { lz->txt, lz->txt + lz->len, lz->mm };
+	struct lazy *member;
+	const char *start;
+	char *k;
+
+	if (lz->index)
+		return true;
+	else if (lz->broken)
+		return false;
+
+	lz->broken = true;
+
+	ws(&fj);
+	if (fj.p >= fj.end || *fj.p++ != '{')
+		return false;
+
+	lz->index = thash_create_strkey(NULL, lz->mm);
+
+	ws(&fj);
+	if (fj.p < fj.end && *fj.p == '}') {
+		fj.p++;
+		goto end;
+	}
+
+	for (;;) {
+		ws(&fj);
+		if (fj.p >= fj.end || *fj.p++ != '"' || !(k = string(&fj)))
+			goto fail;
+
+		ws(&fj);
+		if (fj.p >= fj.end || *fj.p++ != ':')
+			goto fail;
+
+		ws(&fj);
+		start = fj.p;
+		if (!skip(&fj, 1))
+			goto fail;
+
+		member = fastjson_lazy(start, fj.p - start, lz->mm);
+		thash_set(lz->index, k, member);
+
+		ws(&fj);
+		if (fj.p >= fj.end)
+			goto fail;
+
+		if (*fj.p == ',') {
+			fj.p++;
+		} else if (*fj.p++ == '}') {
+			break;
+		} else goto fail;
+	}
+
+end:
+	ws(&fj);
+	if (fj.p != fj.end)
+		goto fail;
+
+	lz->broken = false;
+	return true;
+
+fail:
+	lz->index = NULL;
+	return false;
+}
+
+struct lazy *fastjson_lazy_member(struct lazy *lz, const char *name)
+{
+	if (!fastjson_lazy_index(lz))
+		return NULL;
+
+	return thash_get(lz->index, name);
+}
+
+ut *fastjson_lazy_parse(struct lazy *lz, void *mm)
+{
+	ut *obj;
+	char *txt;
+
+	obj = fastjson_parse(lz->txt, lz->len, mm);
+	if (obj)
+		return obj;
+
+	/* let libpjf decide, giving exactly the same result as without lazy parsing */
+	txt = mmatic_alloc(lz->len + 1, mm);
+	memcpy(txt, lz->txt, lz->len);
+	txt[lz->len] = '\0';
+
+	return json_parse(json_create(mm), txt);
+}
+
+/* for Vim autocompletion:
+ * vim: path=.,/usr/include,/usr/local/include,~/local/include
+ */
@@ -0,0 +1,48 @@
+/*
+ * Fast path JSON parser, using SSE2/AVX2 when available
+ *
+ * Copyright (C) 2009-2010 Pawel Foremski <pawel@foremski.pl>
+ *
+ * Licensed under GPLv3
+ */
+
+#ifndef _FASTJSON_H_
+#define _FASTJSON_H_
+
+/** Parse JSON text
+ * @param txt     JSON text, need not be \0-terminated
+ * @param len     length of txt
+ * @param mm      where to allocate the result
+ * @retval NULL   input not supported by the fast path - use json_parse() instead */
+ut *fastjson_parse(const char *txt, size_t len, void *mm);
+
+/** Find first byte in JSON string contents that needs special handling
+ * That is: '"', '\\', control characters and non-ASCII bytes.
+ * @return offset of the byte, or len if none found */
+size_t fastjson_scan(const char *p, size_t len);
+
+/** Raw JSON text of a value, parsed on demand */
+struct lazy {
+	const char *txt;                   /** JSON text, not \0-terminated */
+	size_t len;                        /** length of txt */
+	void *mm;                          /** where to allocate */
+	thash *index;                      /** if txt is an object: member name => struct lazy */
+	bool broken;                       /** if true, indexing failed */
+};
+
+/** Wrap JSON text for lazy parsing, without looking at it yet */
+struct lazy *fastjson_lazy(const char *txt, size_t len, void *mm);
+
+/** Index members of JSON object in lz, without parsing their values
+ * @retval false  lz is not a well-formed object, or uses features not supported by the fast path */
+bool fastjson_lazy_index(struct lazy *lz);
+
+/** Get raw member of JSON object, indexing it on first use
+ * @retval NULL   member not found, or lz could not be indexed */
+struct lazy *fastjson_lazy_member(struct lazy *lz, const char *name);
+
+/** Parse lazy value, falling back to json_parse() if needed
+ * @return parsed object or ut_err */
+ut *fastjson_lazy_parse(struct lazy *lz, void *mm);
+
+#endif
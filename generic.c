@@ -36,12 +36,15 @@ bool generic_fw(struct req *req, struct fw *fw)
 	for (; fw->name; fw++) {
 		dbg(12, "%s: checking\n", fw->name);
 
-		param = uth_get(req->params, fw->name);
+		param = rpcd_param(req, fw->name);
 		if (!param) {
 			if (fw->required)
 				return err(JSON_RPC_INVALID_PARAMS, "Parameter required", fw->name);
 			else
 				continue;
+		} else if (!ut_ok(param)) {
+			req->reply = param;
+			return false;
 		}
 
 		if (ut_type(param) != fw->type) {
@@ -0,0 +1,455 @@
+/*
+ * JavaScript modules, run in-process by the embedded QuickJS engine
+ *
+ * A module is a script defining a global function handle(params, cfg), which returns the reply or
+ * throws an error - either a string, or an object with "code", "message" and "data" properties.
+ * Nested procedures can be called with rpcd.call(method, params).
+ *
+ * Each module gets its own QuickJS runtime. The script is compiled to bytecode once, in js_init(),
+ * and instantiated in a small pool of contexts, so that global state survives between calls and
+ * nested calls of the same module have a fresh context. Module configuration:
+ *   - timeout:     max time of a single call in seconds (default none)
+ *   - js_memory:   memory limit of the runtime in bytes (default none)
+ *   - js_pool:     max number of idle contexts kept (default 2)
+ *
+ * Build with "make QUICKJS=<prefix>", see Makefile.
+ *
+ * Copyright (C) 2009-2010 Pawel Foremski <pawel@foremski.pl>
+ *
+ * Licensed under GPLv3
+ */
+
+#include <time.h>
+#include <quickjs.h>
+#include "common.h"
+
+/** Nesting limit for conversions */
+#define JS_DEPTH_MAX 64
+
+/** Engine state of a module */
+struct jsmod {
+	struct mod *mod;                   /** module */
+	JSRuntime *rt;                     /** runtime, shared by all contexts */
+	uint8_t *bc;                       /** compiled script */
+	size_t bclen;                      /** length of bc */
+	tlist *pool;                       /** idle contexts */
+	int poolmax;                       /** max length of pool */
+	long long deadline;                /** when to interrupt current call, 0 means never */
+	bool timedout;                     /** if true, current call was interrupted */
+};
+
+/** Milliseconds since some point in the past */
+static long long msnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/** QuickJS interrupt handler, called periodically while running the script */
+static int js_interrupt(JSRuntime *rt, void *opaque)
+{
+	struct jsmod *jm = opaque;
+
+	if (jm->deadline > 0 && msnow() >= jm->deadline) {
+		jm->timedout = true;
+		return 1;
+	}
+
+	return 0;
+}
+
+static JSValue ut2js(JSContext *ctx, ut *v, int depth)
+{
+	JSValue obj;
+	tlist *list;
+	thash *hash;
+	ut *el;
+	char *k;
+	uint32_t i = 0;
+
+	if (depth > JS_DEPTH_MAX)
+		return JS_NULL;
+
+	switch (ut_type(v)) {
+		case T_NULL:
+			return JS_NULL;
+		case T_BOOL:
+			return JS_NewBool(ctx, ut_bool(v));
+		case T_INT:
+			return JS_NewInt32(ctx, ut_int(v));
+		case T_DOUBLE:
+			return JS_NewFloat64(ctx, ut_double(v));
+		case T_LIST:
+			obj = JS_NewArray(ctx);
+			list = ut_tlist(v);
+			TLIST_ITER_LOOP(list, el)
+				JS_SetPropertyUint32(ctx, obj, i++, ut2js(ctx, el, depth + 1));
+			return obj;
+		case T_HASH:
+			obj = JS_NewObject(ctx);
+			hash = ut_thash(v);
+			THASH_ITER_LOOP(hash, k, el)
+				JS_SetPropertyStr(ctx, obj, k, ut2js(ctx, el, depth + 1));
+			return obj;
+		default:
+			return JS_NewString(ctx, ut_char(v));
+	}
+}
+
+static ut *js2ut(JSContext *ctx, JSValueConst val, void *mm, int depth)
+{
+	JSPropertyEnum *props;
+	JSValue el;
+	tlist *list;
+	thash *hash;
+	const char *str;
+	size_t len;
+	uint32_t n, i;
+	int32_t iv;
+	double dv;
+	ut *v;
+
+	if (depth > JS_DEPTH_MAX)
+		return ut_new_null(mm);
+
+	if (JS_IsNull(val) || JS_IsUndefined(val)) {
+		return ut_new_null(mm);
+	} else if (JS_IsBool(val)) {
+		return ut_new_bool(JS_ToBool(ctx, val), mm);
+	} else if (JS_VALUE_GET_TAG(val) == JS_TAG_INT) {
+		JS_ToInt32(ctx, &iv, val);
+		return ut_new_int(iv, mm);
+	} else if (JS_IsNumber(val)) {
+		JS_ToFloat64(ctx, &dv, val);
+		return ut_new_double(dv, mm);
+	} else if (JS_IsArray(ctx, val) > 0) {
+		el = JS_GetPropertyStr(ctx, val, "length");
+		JS_ToInt32(ctx, &iv, el);
+		JS_FreeValue(ctx, el);
+
+		list = tlist_create(NULL, mm);
+		for (i = 0; i < iv; i++) {
+			el = JS_GetPropertyUint32(ctx, val, i);
+			tlist_push(list, js2ut(ctx, el, mm, depth + 1));
+			JS_FreeValue(ctx, el);
+		}
+
+		return ut_new_tlist(list, mm);
+	} else if (JS_IsObject(val) && !JS_IsFunction(ctx, val)) {
+		hash = thash_create_strkey(NULL, mm);
+
+		if (JS_GetOwnPropertyNames(ctx, &props, &n, val, JS_GPN_STRING_MASK | JS_GPN_ENUM_ONLY) == 0) {
+			for (i = 0; i < n; i++) {
+				str = JS_AtomToCString(ctx, props[i].atom);
+				el = JS_GetProperty(ctx, val, props[i].atom);
+
+				if (str)
+					thash_set(hash, mmatic_strdup(str, mm), js2ut(ctx, el, mm, depth + 1));
+
+				JS_FreeValue(ctx, el);
+				JS_FreeCString(ctx, str);
+				JS_FreeAtom(ctx, props[i].atom);
+			}
+			js_free(ctx, props);
+		}
+
+		return ut_new_thash(hash, mm);
+	}
+
+	str = JS_ToCStringLen(ctx, &len, val);
+	if (!str)
+		return ut_new_null(mm);
+
+	v = ut_new_char(str, mm);
+	JS_FreeCString(ctx, str);
+	return v;
+}
+
+/** rpcd.call(method, params) */
+static JSValue js_call(JSContext *ctx, JSValueConst this, int argc, JSValueConst *argv)
+{
+	struct req *req = JS_GetContextOpaque(ctx);
+	const char *method;
+	ut *params, *rep;
+	JSValue ret;
+
+	if (argc < 1 || !(method = JS_ToCString(ctx, argv[0])))
+		return JS_ThrowTypeError(ctx, "rpcd.call(): method name expected");
+
+	params = (argc > 1) ? js2ut(ctx, argv[1], req, 0) : ut_new_thash(NULL, req);
+	rep = rpcd_subrequest(req, method, params);
+	JS_FreeCString(ctx, method);
+
+	if (!ut_ok(rep)) {
+		ret = JS_NewError(ctx);
+		JS_SetPropertyStr(ctx, ret, "code", JS_NewInt32(ctx, ut_errcode(rep)));
+		JS_SetPropertyStr(ctx, ret, "message", JS_NewString(ctx, ut_err(rep)));
+		return JS_Throw(ctx, ret);
+	}
+
+	return ut2js(ctx, rep, 0);
+}
+
+/** Get context from pool or make new one
+ * @retval NULL  failed */
+static JSContext *ctx_get(struct jsmod *jm)
+{
+	JSContext *ctx;
+	JSValue obj, rpcd;
+
+	if (tlist_count(jm->pool) > 0)
+		return tlist_shift(jm->pool);
+
+	ctx = JS_NewContext(jm->rt);
+	if (!ctx)
+		return NULL;
+
+	rpcd = JS_NewObject(ctx);
+	JS_SetPropertyStr(ctx, rpcd, "call", JS_NewCFunction(ctx, js_call, "call", 2));
+	obj = JS_GetGlobalObject(ctx);
+	JS_SetPropertyStr(ctx, obj, "rpcd", rpcd);
+	JS_FreeValue(ctx, obj);
+
+	/* run the script, defining handle() */
+	obj = JS_ReadObject(ctx, jm->bc, jm->bclen, JS_READ_OBJ_BYTECODE);
+	if (!JS_IsException(obj))
+		obj = JS_EvalFunction(ctx, obj);
+
+	if (JS_IsException(obj)) {
+		dbg(1, "%s: script failed\n", jm->mod->path);
+		JS_FreeValue(ctx, JS_GetException(ctx));
+		JS_FreeContext(ctx);
+		return NULL;
+	}
+
+	JS_FreeValue(ctx, obj);
+	return ctx;
+}
+
+/** Give context back to pool */
+static void ctx_put(struct jsmod *jm, JSContext *ctx)
+{
+	if (tlist_count(jm->pool) < jm->poolmax)
+		tlist_push(jm->pool, ctx);
+	else
+		JS_FreeContext(ctx);
+}
+
+/** Convert pending exception to request error */
+static bool js_error(struct req *req, JSContext *ctx)
+{
+	JSValue exc, v;
+	const char *msg;
+	ut *data = NULL;
+	int32_t code = JSON_RPC_ERROR;
+	bool rc;
+
+	exc = JS_GetException(ctx);
+
+	if (JS_IsObject(exc)) {
+		v = JS_GetPropertyStr(ctx, exc, "code");
+		if (JS_IsNumber(v))
+			JS_ToInt32(ctx, &code, v);
+		JS_FreeValue(ctx, v);
+
+		v = JS_GetPropertyStr(ctx, exc, "data");
+		if (!JS_IsUndefined(v))
+			data = js2ut(ctx, v, req, 0);
+		JS_FreeValue(ctx, v);
+
+		v = JS_GetPropertyStr(ctx, exc, "message");
+		msg = JS_ToCString(ctx, v);
+		JS_FreeValue(ctx, v);
+	} else {
+		msg = JS_ToCString(ctx, exc);
+	}
+
+	rc = err(code, msg ? msg : "Exception", data ? ut_char(data) : NULL);
+
+	JS_FreeCString(ctx, msg);
+	JS_FreeValue(ctx, exc);
+	return rc;
+}
+
+static bool js_init(struct mod *mod)
+{
+	struct jsmod *jm;
+	JSRuntime *rt;
+	JSContext *ctx;
+	JSValue fun, exc;
+	const char *msg;
+	uint8_t *bc;
+	char *src;
+	int mem;
+	bool ok;
+
+	src = asn_readfile(mod->path, mod->mm);
+	if (!src) {
+		dbg(1, "%s: could not read file\n", mod->path);
+		return false;
+	}
+
+	rt = JS_NewRuntime();
+	if (!rt) {
+		dbg(1, "%s: could not create JS runtime\n", mod->path);
+		return false;
+	}
+
+	jm = mmatic_zalloc(sizeof *jm, mod->mm);
+	jm->mod = mod;
+	jm->rt = rt;
+	jm->pool = tlist_create(NULL, mod->mm);
+	jm->poolmax = uth_int(mod->cfg, "js_pool");
+	if (jm->poolmax <= 0)
+		jm->poolmax = 2;
+
+	mem = uth_int(mod->cfg, "js_memory");
+	if (mem > 0)
+		JS_SetMemoryLimit(rt, mem);
+	JS_SetInterruptHandler(rt, js_interrupt, jm);
+
+	/* compile once, keep the bytecode */
+	ctx = JS_NewContext(rt);
+	if (!ctx) {
+		dbg(1, "%s: could not create JS context\n", mod->path);
+		goto fail;
+	}
+
+	fun = JS_Eval(ctx, src, strlen(src), mod->path, JS_EVAL_TYPE_GLOBAL | JS_EVAL_FLAG_COMPILE_ONLY);
+	if (JS_IsException(fun)) {
+		exc = JS_GetException(ctx);
+		msg = JS_ToCString(ctx, exc);
+		dbg(1, "%s: %s\n", mod->path, msg ? msg : "compilation failed");
+		JS_FreeCString(ctx, msg);
+		JS_FreeValue(ctx, exc);
+		JS_FreeContext(ctx);
+		goto fail;
+	}
+
+	bc = JS_WriteObject(ctx, &jm->bclen, fun, JS_WRITE_OBJ_BYTECODE);
+	JS_FreeValue(ctx, fun);
+	JS_FreeContext(ctx);
+
+	if (!bc)
+		goto fail;
+
+	jm->bc = mmatic_alloc(jm->bclen, mod->mm);
+	memcpy(jm->bc, bc, jm->bclen);
+	js_free_rt(rt, bc);
+
+	/* check it defines handle() */
+	ctx = ctx_get(jm);
+	if (!ctx)
+		goto fail;
+
+	fun = JS_GetGlobalObject(ctx);
+	exc = JS_GetPropertyStr(ctx, fun, "handle");
+	ok = JS_IsFunction(ctx, exc);
+	JS_FreeValue(ctx, exc);
+	JS_FreeValue(ctx, fun);
+
+	if (!ok) {
+		dbg(1, "%s: handle() not defined\n", mod->path);
+		JS_FreeContext(ctx);
+		goto fail;
+	}
+	ctx_put(jm, ctx);
+
+	uth_set_ptr(mod->prv, "js", jm);
+	return true;
+
+fail:
+	JS_FreeRuntime(rt);
+	return false;
+}
+
+static bool js_deinit(struct mod *mod)
+{
+	struct jsmod *jm = ut_ptr(uth_get(mod->prv, "js"));
+	JSContext *ctx;
+
+	if (!jm)
+		return true;
+
+	while ((ctx = tlist_shift(jm->pool)))
+		JS_FreeContext(ctx);
+
+	JS_FreeRuntime(jm->rt);
+	return true;
+}
+
+static bool js_handle(struct req *req)
+{
+	struct jsmod *jm = ut_ptr(uth_get(req->mod->prv, "js"));
+	JSContext *ctx;
+	JSValue glob, fun, args[2], ret;
+	long long deadline;
+	int timeout;
+	bool rc = true;
+
+	/* handle() gets all params, even with "lazy_params" */
+	if (!rpcd_params(req))
+		return false;
+
+	ctx = ctx_get(jm);
+	if (!ctx)
+		return errcode(JSON_RPC_INTERNAL_ERROR);
+
+	JS_SetContextOpaque(ctx, req);
+
+	glob = JS_GetGlobalObject(ctx);
+	fun = JS_GetPropertyStr(ctx, glob, "handle");
+	JS_FreeValue(ctx, glob);
+
+	if (!JS_IsFunction(ctx, fun)) {
+		JS_FreeValue(ctx, fun);
+		ctx_put(jm, ctx);
+		return err(JSON_RPC_INTERNAL_ERROR, NULL, "handle() not defined");
+	}
+
+	/* nested calls of the same module keep the outer deadline */
+	deadline = jm->deadline;
+	timeout = uth_int(req->mod->cfg, "timeout");
+	if (timeout > 0 && (deadline == 0 || msnow() + timeout * 1000 < deadline))
+		jm->deadline = msnow() + timeout * 1000;
+
+	args[0] = ut2js(ctx, req->params, 0);
+	args[1] = ut2js(ctx, req->mod->cfg, 0);
+	ret = JS_Call(ctx, fun, JS_UNDEFINED, 2, args);
+
+	if (JS_IsException(ret)) {
+		if (jm->timedout) {
+			JS_FreeValue(ctx, JS_GetException(ctx));
+			rpcd_timeout(req->mod);
+			rc = err(JSON_RPC_TIMEOUT, NULL, req->mod->path);
+		} else {
+			rc = js_error(req, ctx);
+		}
+	} else {
+		req->reply = js2ut(ctx, ret, req, 0);
+	}
+
+	jm->deadline = deadline;
+	jm->timedout = false;
+
+	JS_FreeValue(ctx, ret);
+	JS_FreeValue(ctx, args[0]);
+	JS_FreeValue(ctx, args[1]);
+	JS_FreeValue(ctx, fun);
+	ctx_put(jm, ctx);
+
+	return rc;
+}
+
+struct api js_api = {
+	.tag    = RPCD_TAG,
+	.init   = js_init,
+	.deinit = js_deinit,
+	.handle = js_handle,
+};
+
+/* for Vim autocompletion:
+ * vim: path=.,/usr/include,/usr/local/include,~/local/include
+ */
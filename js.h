@@ -0,0 +1,15 @@
+/*
+ * JavaScript modules, see js.c
+ *
+ * Copyright (C) 2009-2010 Pawel Foremski <pawel@foremski.pl>
+ *
+ * Licensed under GPLv3
+ */
+
+#ifndef _JS_H_
+#define _JS_H_
+
+/** Available if built with QuickJS, see Makefile */
+extern struct api js_api;
+
+#endif
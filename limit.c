@@ -0,0 +1,244 @@
+/*
+ * Concurrency limits shared between rpcd processes
+ *
+ * Each limited module or directory gets a SysV semaphore set: semaphore 0 counts free execution
+ * slots, semaphore 1 counts free places in the queue. All operations use SEM_UNDO, so the kernel
+ * gives back whatever a crashed process held. See sem_overview(7) and ipcs(1).
+ *
+ * The set also remembers the limits it was set up with, so that processes started after a config
+ * change can adjust it - semaphores outlive rpcd processes.
+ *
+ * Copyright (C) 2009-2010 Pawel Foremski <pawel@foremski.pl>
+ *
+ * Licensed under GPLv3
+ */
+
+#define _GNU_SOURCE 1
+
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/sem.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdlib.h>
+#include "common.h"
+
+#define LIMIT_TIMEOUT 1000             /** default queue_timeout, in ms */
+
+/** Semaphores in a set */
+enum {
+	SEM_SLOTS = 0,                     /** free execution slots */
+	SEM_PLACES,                        /** free places in queue */
+	SEM_MAX,                           /** max_concurrency the set is configured for */
+	SEM_QUEUE,                         /** max_queue the set is configured for */
+	SEM_LOCK,                          /** 1 if nobody is reconfiguring the set */
+	SEM_COUNT
+};
+
+union semun {
+	int val;
+	struct semid_ds *buf;
+	unsigned short *array;
+};
+
+struct limit {
+	const char *path;                  /** module or directory path */
+	int proj;                          /** kind of limit, part of IPC key */
+	int max;                           /** max_concurrency: max calls running at once */
+	int queue;                         /** max_queue: max calls waiting for a free slot */
+	int timeout;                       /** queue_timeout: max time to wait, in ms */
+	int semid;                         /** SysV semaphore set */
+};
+
+/** IPC key of limit: hash of its kind and real path
+ * Not ftok(), which uses just the low bits of inode number - and so gives the same key to
+ * unrelated files often enough. */
+static key_t ipckey(struct limit *l)
+{
+	char buf[PATH_MAX];
+	const char *p = realpath(l->path, buf) ? buf : l->path;
+	uint32_t h = (2166136261U ^ l->proj) * 16777619U;
+
+	for (; *p; p++)
+		h = (h ^ (unsigned char) *p) * 16777619U;
+
+	return (h == IPC_PRIVATE) ? 1 : (key_t) h;
+}
+
+/** Adjust an existing set to limits of l, if it was set up with other ones
+ * Moves the counters by the difference, so that slots in use stay accounted for. */
+static void reconfigure(struct limit *l, int semid)
+{
+	struct sembuf lock = { SEM_LOCK, -1, SEM_UNDO }, unlock = { SEM_LOCK, 1, SEM_UNDO };
+	struct sembuf ops[4];
+	struct timespec ts = { 1, 0 };
+	int max, queue, n = 0;
+
+	if (semtimedop(semid, &lock, 1, &ts) == -1) {
+		dbg(1, "%s: could not lock limit: %s\n", l->path, strerror(errno));
+		return;
+	}
+
+	max = semctl(semid, SEM_MAX, GETVAL);
+	queue = semctl(semid, SEM_QUEUE, GETVAL);
+
+	/* sem_op 0 would mean waiting for zero */
+	if (max >= 0 && max != l->max) {
+		ops[n++] = (struct sembuf) { SEM_SLOTS, l->max - max, 0 };
+		ops[n++] = (struct sembuf) { SEM_MAX, l->max - max, 0 };
+	}
+	if (queue >= 0 && queue != l->queue) {
+		ops[n++] = (struct sembuf) { SEM_PLACES, l->queue - queue, 0 };
+		ops[n++] = (struct sembuf) { SEM_QUEUE, l->queue - queue, 0 };
+	}
+
+	if (n > 0) {
+		dbg(1, "%s: limits changed from %d/%d to %d/%d\n", l->path, max, queue, l->max, l->queue);
+
+		/* lowering the limits waits for enough calls to finish */
+		if (semtimedop(semid, ops, n, &ts) == -1)
+			dbg(0, "%s: could not apply new limits: %s\n", l->path, strerror(errno));
+	}
+
+	semop(semid, &unlock, 1);
+}
+
+/** Get semaphore set, creating and initializing it if needed
+ * @retval -1   failed */
+static int semaphores(struct limit *l)
+{
+	key_t key = ipckey(l);
+	int semid, i;
+	union semun arg;
+	unsigned short vals[SEM_COUNT] = { l->max, l->queue, l->max, l->queue, 1 };
+	struct sembuf touch[2] = { { SEM_SLOTS, 1, 0 }, { SEM_SLOTS, -1, 0 } };
+	struct semid_ds ds;
+
+	semid = semget(key, SEM_COUNT, IPC_CREAT | IPC_EXCL | 0600);
+	if (semid >= 0) {
+		arg.array = vals;
+		if (semctl(semid, 0, SETALL, arg) == -1 || semop(semid, touch, 2) == -1)
+			return -1;
+
+		return semid;
+	} else if (errno != EEXIST) {
+		return -1;
+	}
+
+	/* someone else created it - wait until it is initialized, ie. sem_otime is set */
+	semid = semget(key, SEM_COUNT, 0600);
+	if (semid == -1)
+		return -1;
+
+	arg.buf = &ds;
+	for (i = 0; i < 100; i++) {
+		if (semctl(semid, 0, IPC_STAT, arg) == 0 && ds.sem_otime != 0) {
+			reconfigure(l, semid);
+			return semid;
+		}
+
+		usleep(1000);
+	}
+
+	return -1;
+}
+
+struct limit *limit_create(const char *path, ut *cfg, void *mm)
+{
+	struct limit *l;
+	ut *v;
+
+	if (!cfg || !(v = uth_get(cfg, "max_concurrency")) || ut_int(v) <= 0)
+		return NULL;
+
+	l = mmatic_zalloc(sizeof *l, mm);
+	l->path = path;
+	l->proj = 'L';
+	l->max = ut_int(v);
+	l->queue = (v = uth_get(cfg, "max_queue")) ? MAX(ut_int(v), 0) : 0;
+	l->timeout = (v = uth_get(cfg, "queue_timeout")) ? MAX(ut_int(v), 0) : LIMIT_TIMEOUT;
+
+	l->semid = semaphores(l);
+	if (l->semid == -1) {
+		dbg(0, "%s: could not set up concurrency limit: %s\n", path, strerror(errno));
+		mmatic_freeptr(l);
+		return NULL;
+	}
+
+	dbg(3, "%s: max_concurrency=%d max_queue=%d queue_timeout=%dms\n",
+		path, l->max, l->queue, l->timeout);
+
+	return l;
+}
+
+struct limit *limit_connections(const char *path, int max, void *mm)
+{
+	struct limit *l;
+
+	if (max <= 0)
+		return NULL;
+
+	l = mmatic_zalloc(sizeof *l, mm);
+	l->path = path;
+	l->proj = 'C';
+	l->max = max;
+
+	l->semid = semaphores(l);
+	if (l->semid == -1) {
+		dbg(0, "%s: could not set up connection limit: %s\n", path, strerror(errno));
+		mmatic_freeptr(l);
+		return NULL;
+	}
+
+	return l;
+}
+
+bool limit_enter(struct req *req, struct limit *l)
+{
+	struct sembuf slot = { SEM_SLOTS, -1, SEM_UNDO | IPC_NOWAIT };
+	struct sembuf place = { SEM_PLACES, -1, SEM_UNDO | IPC_NOWAIT };
+	struct sembuf unplace = { SEM_PLACES, 1, SEM_UNDO };
+	struct timespec ts;
+	int rc;
+
+	if (!l)
+		return true;
+
+	/* fast path: free slot */
+	if (semop(l->semid, &slot, 1) == 0)
+		return true;
+	else if (errno != EAGAIN)
+		return errsys("semop()");
+
+	/* get in the queue, if there is room */
+	if (l->queue == 0 || semop(l->semid, &place, 1) == -1)
+		return err(JSON_RPC_OVERLOADED, NULL, "queue full");
+
+	ts.tv_sec = l->timeout / 1000;
+	ts.tv_nsec = (l->timeout % 1000) * 1000000;
+	slot.sem_flg = SEM_UNDO;
+
+	rc = semtimedop(l->semid, &slot, 1, &ts);
+	semop(l->semid, &unplace, 1);
+
+	if (rc == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return err(JSON_RPC_OVERLOADED, NULL, "queue timeout");
+		else
+			return errsys("semtimedop()");
+	}
+
+	return true;
+}
+
+void limit_leave(struct limit *l)
+{
+	struct sembuf slot = { SEM_SLOTS, 1, SEM_UNDO };
+
+	if (l)
+		semop(l->semid, &slot, 1);
+}
+
+/* for Vim autocompletion:
+ * vim: path=.,/usr/include,/usr/local/include,~/local/include
+ */
@@ -0,0 +1,33 @@
+/*
+ * Concurrency limits shared between rpcd processes
+ *
+ * Copyright (C) 2009-2010 Pawel Foremski <pawel@foremski.pl>
+ *
+ * Licensed under GPLv3
+ */
+
+#ifndef _LIMIT_H_
+#define _LIMIT_H_
+
+/** Set up concurrency limit
+ * @param path    module or directory path, identifies the limit among rpcd processes
+ * @param cfg     config with max_concurrency, max_queue and queue_timeout options
+ * @retval NULL   no limit configured, or setting it up failed */
+struct limit *limit_create(const char *path, ut *cfg, void *mm);
+
+/** Set up limit on number of client connections, ie. rpcd processes
+ * Used like any other limit, without a queue.
+ * @param path    config file, identifies the limit among rpcd processes
+ * @param max     max connections
+ * @retval NULL   no limit, or setting it up failed */
+struct limit *limit_connections(const char *path, int max, void *mm);
+
+/** Take a slot, waiting in queue if needed
+ * @param l       limit, may be NULL
+ * @retval false  no slot available in time - error set in req->reply */
+bool limit_enter(struct req *req, struct limit *l);
+
+/** Give back slot taken with limit_enter() */
+void limit_leave(struct limit *l);
+
+#endif
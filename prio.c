@@ -0,0 +1,290 @@
+/*
+ * Weighted fair scheduling of requests between priority classes
+ *
+ * rpcd runs as many processes, so the scheduler lives in shared memory. At most "workers"
+ * requests run at once; others wait in the queue of their class, and each freed slot goes to
+ * the class with the lowest virtual time, which grows by 1/weight with each slot granted.
+ *
+ * Example config:
+ *   * = { scheduler = { workers = 16, timeout = 5000, classes = { ui = 10, batch = 1 } } }
+ *   app = { * = { class = "ui" } ... }
+ *
+ * Copyright (C) 2009-2010 Pawel Foremski <pawel@foremski.pl>
+ *
+ * Licensed under GPLv3
+ */
+
+#define _GNU_SOURCE 1
+
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "common.h"
+
+#define PRIO_TIMEOUT 5000             /** default time to wait for a slot, in ms */
+#define PRIO_STALE   5                /** free slots reserved for longer than that, in s */
+
+/** Scheduler config, local to process */
+struct prio {
+	struct prio_state *st;            /** shared state */
+	int workers;                       /** max requests running at once */
+	int timeout;                       /** max time to wait, in ms */
+	thash *classes;                    /** class name => index + 1 */
+	double weights[PRIO_CLASSES];     /** class weights */
+};
+
+/** Milliseconds since some point in the past */
+static long long msnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static long futex(uint32_t *addr, int op, uint32_t val, const struct timespec *ts)
+{
+	return syscall(SYS_futex, addr, op, val, ts, NULL, 0);
+}
+
+/** What rpcd->prio points at if there is no scheduler, so that prio_get() looks just once */
+static struct prio none;
+
+/** Read scheduler config
+ * @retval NULL   not configured, or not available */
+static struct prio *prio_get(struct rpcd *rpcd)
+{
+	struct prio *s;
+	ut *cfg, *v;
+	const char *name;
+	int n = 0;
+
+	if (rpcd->prio)
+		return (rpcd->prio == &none) ? NULL : rpcd->prio;
+
+	rpcd->prio = &none;
+
+	if (!rpcd->cfg || !(cfg = uth_get(rpcd->cfg, "scheduler")) || !ut_is_thash(cfg))
+		return NULL;
+
+	s = mmatic_zalloc(sizeof *s, rpcd);
+	s->workers = MIN(MAX(uth_int(cfg, "workers"), 1), PRIO_SLOTS);
+	s->timeout = (v = uth_get(cfg, "timeout")) ? ut_int(v) : PRIO_TIMEOUT;
+	s->classes = thash_create_strkey(NULL, s);
+
+	if ((v = uth_get(cfg, "classes")) && ut_is_thash(v)) {
+		THASH_ITER_LOOP(ut_thash(v), name, cfg) {
+			if (n == PRIO_CLASSES) {
+				dbg(0, "scheduler: too many classes, ignoring '%s'\n", name);
+				continue;
+			}
+
+			s->weights[n] = MAX(ut_double(cfg), 0.001);
+			thash_set(s->classes, name, (void *) (long) (n + 1));
+			n++;
+		}
+	}
+
+	/* the default class */
+	if (n == 0)
+		s->weights[0] = 1;
+
+	s->st = shm_prio(rpcd);
+	if (!s->st) {
+		dbg(0, "scheduler: shared memory not available, scheduling disabled\n");
+		mmatic_freeptr(s);
+		return NULL;
+	}
+
+	rpcd->prio = s;
+	return s;
+}
+
+/** Lock shared state, recovering it after dead owner */
+static void lock(struct prio_state *st)
+{
+	if (pthread_mutex_lock(&st->mutex) == EOWNERDEAD)
+		pthread_mutex_consistent(&st->mutex);
+}
+
+/** Find slot with given pid, reclaiming slots of dead processes if none
+ * @retval NULL   none found */
+static struct prio_slot *slot_find(struct prio *s, pid_t pid, bool reclaim)
+{
+	struct prio_state *st = s->st;
+	struct prio_slot *sl;
+	time_t now = time(NULL);
+	int i;
+
+	for (i = 0; i < s->workers; i++) {
+		if (st->slots[i].pid == pid)
+			return &st->slots[i];
+	}
+
+	if (!reclaim || pid != 0)
+		return NULL;
+
+	for (i = 0; i < s->workers; i++) {
+		sl = &st->slots[i];
+
+		if (sl->pid > 0 && kill(sl->pid, 0) == -1 && errno == ESRCH) {
+			dbg(1, "scheduler: reclaiming slot of dead process %d\n", (int) sl->pid);
+			sl->pid = 0;
+			return sl;
+		}
+
+		if (sl->pid == -1 && now - sl->since > PRIO_STALE) {
+			dbg(1, "scheduler: reclaiming slot not taken by class %d\n", sl->cls);
+			if (st->classes[sl->cls].grants > 0)
+				st->classes[sl->cls].grants--;
+			sl->pid = 0;
+			return sl;
+		}
+	}
+
+	return NULL;
+}
+
+/** Find slot reserved for given class by dispatch()
+ * @retval NULL   none found */
+static struct prio_slot *slot_reserved(struct prio *s, int cls)
+{
+	int i;
+
+	for (i = 0; i < s->workers; i++) {
+		if (s->st->slots[i].pid == -1 && s->st->slots[i].cls == cls)
+			return &s->st->slots[i];
+	}
+
+	return NULL;
+}
+
+/** Hand free slots over to waiting classes, by weighted fair queuing */
+static void dispatch(struct prio *s)
+{
+	struct prio_state *st = s->st;
+	struct prio_slot *sl;
+	int i, best;
+
+	while ((sl = slot_find(s, 0, false))) {
+		best = -1;
+		for (i = 0; i < PRIO_CLASSES; i++) {
+			if (st->classes[i].waiting > 0 && (best < 0 || st->classes[i].vtime < st->classes[best].vtime))
+				best = i;
+		}
+
+		if (best < 0)
+			break;
+
+		st->vnow = st->classes[best].vtime;
+		st->classes[best].vtime += 1.0 / s->weights[best];
+		st->classes[best].waiting--;
+		st->classes[best].grants++;
+
+		sl->pid = -1;
+		sl->cls = best;
+		sl->since = time(NULL);
+
+		futex(&st->classes[best].grants, FUTEX_WAKE, INT32_MAX, NULL);
+	}
+}
+
+bool prio_enter(struct req *req)
+{
+	struct prio *s;
+	struct prio_state *st;
+	struct prio_class *c;
+	struct prio_slot *sl;
+	struct timespec ts;
+	const char *name;
+	pid_t pid = getpid();
+	long long deadline, left;
+	int cls = 0, i;
+	bool queue = false;
+
+	if (!(s = prio_get(req->mod->dir->svc->rpcd)))
+		return true;
+
+	st = s->st;
+	if ((name = uth_char(req->mod->cfg, "class")))
+		cls = MAX((long) thash_get(s->classes, name) - 1, 0);
+
+	c = &st->classes[cls];
+	lock(st);
+
+	/* fast path: free slot and nobody waiting */
+	for (i = 0; i < PRIO_CLASSES; i++)
+		queue = queue || st->classes[i].waiting > 0 || st->classes[i].grants > 0;
+
+	if (!queue && (sl = slot_find(s, 0, true))) {
+		sl->pid = pid;
+		pthread_mutex_unlock(&st->mutex);
+		return true;
+	}
+
+	/* class was idle: do not let it use up credit gathered meanwhile */
+	if (c->waiting == 0 && c->grants == 0)
+		c->vtime = MAX(c->vtime, st->vnow);
+
+	c->waiting++;
+	dispatch(s);
+
+	for (deadline = msnow() + s->timeout; ; ) {
+		if (c->grants > 0) {
+			c->grants--;
+
+			/* take the slot reserved for our class - not one granted to another class */
+			if ((sl = slot_reserved(s, cls))) {
+				sl->pid = pid;
+				pthread_mutex_unlock(&st->mutex);
+				return true;
+			}
+
+			/* grant without a slot, eg. after a dead lock owner: queue up again */
+			c->waiting++;
+			dispatch(s);
+			continue;
+		}
+
+		left = deadline - msnow();
+		if (left <= 0) {
+			c->waiting--;
+			pthread_mutex_unlock(&st->mutex);
+			return err(JSON_RPC_OVERLOADED, NULL, "scheduler timeout");
+		}
+
+		pthread_mutex_unlock(&st->mutex);
+
+		/* wait for grant, but check now and then for slots left by dead processes */
+		ts.tv_sec = 0;
+		ts.tv_nsec = MIN(left, 100) * 1000000;
+		futex(&c->grants, FUTEX_WAIT, 0, &ts);
+
+		lock(st);
+		if (slot_find(s, 0, true))
+			dispatch(s);
+	}
+}
+
+void prio_leave(struct req *req)
+{
+	struct prio *s;
+	struct prio_slot *sl;
+
+	if (!(s = req->mod->dir->svc->rpcd->prio) || s == &none)
+		return;
+
+	lock(s->st);
+
+	if ((sl = slot_find(s, getpid(), false)))
+		sl->pid = 0;
+
+	dispatch(s);
+	pthread_mutex_unlock(&s->st->mutex);
+}
+
+/* for Vim autocompletion:
+ * vim: path=.,/usr/include,/usr/local/include,~/local/include
+ */
@@ -0,0 +1,44 @@
+/*
+ * Weighted fair scheduling of requests between priority classes
+ *
+ * Copyright (C) 2009-2010 Pawel Foremski <pawel@foremski.pl>
+ *
+ * Licensed under GPLv3
+ */
+
+#ifndef _PRIO_H_
+#define _PRIO_H_
+
+#include <pthread.h>
+
+#define PRIO_CLASSES 8                /** max number of priority classes */
+#define PRIO_SLOTS   256              /** max number of workers */
+
+/** Scheduler state, kept in shared memory - see shm.c */
+struct prio_state {
+	uint32_t state;                    /** 0: not initialized, 1: ready, else initializing - see shm.c */
+	pthread_mutex_t mutex;             /** process-shared, robust */
+	double vnow;                       /** virtual time of last grant */
+
+	struct prio_class {
+		uint32_t waiting;              /** number of processes waiting for a grant */
+		uint32_t grants;               /** slots handed over to waiters - futex word */
+		double vtime;                  /** virtual time of the class */
+	} classes[PRIO_CLASSES];
+
+	struct prio_slot {
+		pid_t pid;                     /** 0: free, -1: reserved for a waiter */
+		int cls;                       /** if reserved: for which class */
+		time_t since;                  /** if reserved: since when */
+	} slots[PRIO_SLOTS];
+};
+
+/** Wait for a worker slot, according to priority class of req->mod
+ * Does nothing unless "scheduler" is configured in the rpcd "*" section.
+ * @retval false  no slot in time - error set in req->reply */
+bool prio_enter(struct req *req);
+
+/** Give back worker slot taken with prio_enter() */
+void prio_leave(struct req *req);
+
+#endif
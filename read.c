@@ -3,8 +3,22 @@
  * Licensed under GPLv3
  */
 
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include "common.h"
 
+#define HTTP_HEAD_MAX 16384            /** max size of HTTP request line and headers */
+#define HTTP_HEADERS_MAX 100           /** max number of HTTP headers */
+#define HTTP_BINARY_MAX (16 << 20)     /** max size of HTTP body in binary format */
+#define WS_MESSAGE_MAX (16 << 20)      /** max size of WebSocket message */
+
+/** HTTP request head of current request, see readhttp() */
+static char head[HTTP_HEAD_MAX];
+
+/** Bytes read by headline(), including (CR)LFs */
+static unsigned int headsize;
+
 /** Common part of request parser, usually after JSON representation is made available in req->params
  * @param req     the request
  * @param leave   leave the req->params */
@@ -34,12 +48,16 @@ static bool common(struct req *req, bool leave)
 	/* XXX: dont check jsonrpc=2.0 */
 
 	if (!leave) {
+		/* older clients may leave out the id and still want a reply */
+		if (!req->id && !req->http.get && (ut = uth_get(req->params, "jsonrpc")))
+			req->notify = streq(ut_char(ut), "2.0");
+
 		if ((ut = uth_get(req->params, "params")))
 			req->params = ut;
 		else
 			req->params = uth_set_thash(req->params, "params", NULL); /* create empty hash */
 
-		if (ut_is_tlist(req->params) && thash_get(req->http.headers, "X-Qooxdoo-Response-Type")) {
+		if (ut_is_tlist(req->params) && req->http.qooxdoo) {
 			tlist *tl = ut_tlist(req->params);
 			req->params = tlist_shift(tl);
 		}
@@ -48,15 +66,75 @@ static bool common(struct req *req, bool leave)
 	return true;
 }
 
+/** Like common(), but for request body indexed by fastjson_lazy_index() - leaves params unparsed */
+static bool common_lazy(struct req *req, struct lazy *body)
+{
+	static const char *names[] = { "service", "method", "id", "jsonrpc" };
+	const char *version = NULL;
+	const char **fields[] = { &req->service, &req->method, &req->id, &version };
+	struct lazy *lz;
+	ut *ut;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		if (!(lz = fastjson_lazy_member(body, names[i])))
+			continue;
+
+		ut = fastjson_lazy_parse(lz, req);
+		if (!ut_ok(ut)) {
+			req->reply = ut;
+			return false;
+		}
+
+		*fields[i] = ut_char(ut);
+	}
+
+	/* see common() */
+	if (!req->id && version)
+		req->notify = streq(version, "2.0");
+
+	/* see rpcd_param() */
+	req->lazy = fastjson_lazy_member(body, "params");
+	req->params = ut_new_thash(NULL, req);
+
+	return true;
+}
+
+/** Parse JSON-RPC request read into xs */
+static bool parsejson(struct req *req, xstr *xs)
+{
+	struct lazy *body;
+	json *js;
+
+	if (O.fastjson) {
+		/* index the request envelope only, leaving params for later */
+		body = fastjson_lazy(xstr_string(xs), xstr_length(xs), req);
+		if (fastjson_lazy_index(body) && !req->http.qooxdoo)
+			return common_lazy(req, body);
+
+		req->params = fastjson_parse(xstr_string(xs), xstr_length(xs), req);
+	}
+
+	/* fast path gave up or disabled */
+	if (!req->params) {
+		js = json_create(req);
+		req->params = json_parse(js, xstr_string(xs));
+	}
+
+	return common(req, false);
+}
+
 static bool readjson_len(struct req *req, int len)
 {
 	char buf[BUFSIZ];
 	xstr *xs = xstr_create("", req);
-	json *js;
 
 	if (len < 0) {
 		while (fgets(buf, sizeof(buf), stdin)) {
 			if (!buf[0] || buf[0] == '\n') break;
+
+			/* do not count waiting for the request */
+			if (xstr_length(xs) == 0) timing_start(req);
 			xstr_append(xs, buf);
 		}
 	} else {
@@ -79,10 +157,32 @@ static bool readjson_len(struct req *req, int len)
 
 	/* eof? */
 	if (xstr_length(xs) == 0) exit(0);
+	req->insize += xstr_length(xs);
 
-	js = json_create(req);
-	req->params = json_parse(js, xstr_string(xs));
+	return parsejson(req, xs);
+}
+
+/** Read HTTP body of given length in binary format */
+static bool readbinary_len(struct req *req, int len, enum rpc_format fmt)
+{
+	char *buf;
+	int r, got = 0;
 
+	/* the buffer is allocated up front, so do not let the client choose its size freely */
+	if (len > HTTP_BINARY_MAX) {
+		req->last = true;
+		return errmsg("Request body too large");
+	}
+
+	buf = mmatic_alloc(len + 1, req);
+	while (got < len && (r = fread(buf + got, 1, len - got, stdin)) > 0)
+		got += r;
+
+	/* eof in the middle of body */
+	if (got < len) exit(0);
+	req->insize += got;
+
+	req->params = binary_parse(fmt, buf, got, req);
 	return common(req, false);
 }
 
@@ -91,6 +191,21 @@ bool readjson(struct req *req)
 	return readjson_len(req, -1);
 }
 
+bool readbinary(struct req *req)
+{
+	req->format = O.format;
+	req->params = binary_read(O.format, stdin, req);
+
+	/* eof? */
+	if (!req->params) exit(0);
+
+	/* no way to find next message boundary */
+	if (!ut_ok(req->params))
+		req->last = true;
+
+	return common(req, false);
+}
+
 bool read822(struct req *req)
 {
 	char buf[BUFSIZ];
@@ -98,6 +213,7 @@ bool read822(struct req *req)
 
 	while (fgets(buf, sizeof(buf), stdin)) {
 		if (!buf[0] || buf[0] == '\n') break;
+		if (xstr_length(input) == 0) timing_start(req);
 		xstr_append(input, buf);
 	}
 
@@ -113,23 +229,255 @@ bool read822(struct req *req)
 	return common(req, true);
 }
 
+/** Choose reply format from HTTP Accept header, preferring the type listed first
+ * @param def      format to use for wildcard
+ * @retval -1      no supported type */
+static int accept_format(const char *ac, enum rpc_format def)
+{
+	static const char *types[] = {
+		"application/json", "application/msgpack", "application/x-msgpack", "application/cbor", "*/*" };
+	const int fmts[] = {
+		FMT_JSON,           FMT_MSGPACK,           FMT_MSGPACK,             FMT_CBOR,           def };
+	const char *p, *best = NULL;
+	int i, fmt = -1;
+
+	for (i = 0; i < sizeof fmts / sizeof fmts[0]; i++) {
+		p = strstr(ac, types[i]);
+		if (p && (!best || p < best)) {
+			best = p;
+			fmt = fmts[i];
+		}
+	}
+
+	return fmt;
+}
+
+/** Read one line of HTTP request head to head[pos], replacing its (CR)LF with \0
+ * A CR not followed by LF, or a \0 byte, makes the line invalid.
+ * @retval -1   EOF
+ * @retval -2   head too large
+ * @retval -3   malformed line
+ * @return      length of line */
+static int headline(int pos)
+{
+	int c, i = pos;
+
+	while ((c = getc_unlocked(stdin)) != EOF) {
+		headsize++;
+
+		if (c == '\n') {
+			break;
+		} else if (c == '\r') {
+			if (getc_unlocked(stdin) != '\n')
+				return -3;
+			headsize++;
+			break;
+		} else if (c == '\0') {
+			return -3;
+		} else if (i >= HTTP_HEAD_MAX - 1) {
+			return -2;
+		}
+
+		head[i++] = c;
+	}
+
+	if (c == EOF)
+		return -1;
+
+	head[i] = '\0';
+	return i - pos;
+}
+
+/** Match header name, case-insensitive */
+#define HEADER(str) (nlen == sizeof(str) - 1 && strncasecmp(name, str, nlen) == 0)
+
+/** Parse HTTP headers into known-header slots of req->http in a single pass
+ * Each header is stored in head[] as \0-terminated name and value, see rpcd_http_headers().
+ * @param pos     where to start in head[]
+ * @retval false  invalid headers, error set */
+static bool headers(struct req *req, int pos)
+{
+	int len, nlen, vlen, w = pos;
+	char *line, *name, *val, *end;
+	const char **slot;
+
+	req->http.head = head + pos;
+	req->http.count = 0;
+
+	for (;;) {
+		len = headline(w);
+		if (len == -1)
+			exit(0); /* eof */
+		else if (len == -2)
+			return errmsg("Request header too large");
+		else if (len == -3)
+			return errmsg("Malformed request header");
+		else if (len == 0)
+			break;
+
+		if (++req->http.count > HTTP_HEADERS_MAX)
+			return errmsg("Too many request headers");
+
+		/* name: no whitespace (nor obsolete line folding) allowed */
+		line = head + w;
+		end = line + len;
+		name = line;
+		for (nlen = 0; name[nlen] && name[nlen] != ':'; nlen++) {
+			if (name[nlen] == ' ' || name[nlen] == '\t')
+				return errmsg("Malformed request header");
+		}
+		if (name[nlen] != ':' || nlen == 0)
+			return errmsg("Malformed request header");
+
+		/* value: without surrounding whitespace */
+		val = name + nlen + 1;
+		while (*val == ' ' || *val == '\t') val++;
+		while (end > val && (end[-1] == ' ' || end[-1] == '\t')) end--;
+
+		/* store as "name\0value\0", in place */
+		vlen = end - val;
+		name[nlen] = '\0';
+		memmove(name + nlen + 1, val, vlen);
+		val = name + nlen + 1;
+		val[vlen] = '\0';
+		w = (val - head) + vlen + 1;
+
+		slot = NULL;
+		switch (name[0] | 0x20) {
+			case 'a':
+				if (HEADER("Accept")) slot = &req->http.accept;
+				else if (HEADER("Authorization")) slot = &req->http.authorization;
+				break;
+			case 'c':
+				if (HEADER("Content-Type")) slot = &req->http.content_type;
+				else if (HEADER("Connection")) slot = &req->http.connection;
+				else if (HEADER("Content-Length")) {
+					/* conflicting lengths could be used to smuggle requests */
+					if (req->http.content_length && !streq(req->http.content_length, val))
+						return errmsg("Conflicting Content-Length");
+					slot = &req->http.content_length;
+				}
+				break;
+			case 'i':
+				if (HEADER("If-Modified-Since")) slot = &req->http.if_modified_since;
+				else if (HEADER("If-None-Match")) slot = &req->http.if_none_match;
+				break;
+			case 's':
+				if (HEADER("Sec-WebSocket-Key")) slot = &req->http.ws_key;
+				else if (HEADER("Sec-WebSocket-Version")) slot = &req->http.ws_version;
+				break;
+			case 'u':
+				if (HEADER("Upgrade")) slot = &req->http.upgrade;
+				break;
+			case 'x':
+				if (HEADER("X-Qooxdoo-Response-Type")) slot = &req->http.qooxdoo;
+				break;
+		}
+
+		if (slot)
+			*slot = val;
+	}
+
+	return true;
+}
+
+/** Decode URL-encoded string in place */
+static char *urldecode(char *s)
+{
+	char *r, *w, hex[3] = { 0, 0, 0 };
+
+	for (r = w = s; *r; r++, w++) {
+		if (*r == '+') {
+			*w = ' ';
+		} else if (*r == '%' && isxdigit((unsigned char) r[1]) && isxdigit((unsigned char) r[2])) {
+			hex[0] = r[1];
+			hex[1] = r[2];
+			*w = strtol(hex, NULL, 16);
+			r += 2;
+		} else {
+			*w = *r;
+		}
+	}
+
+	*w = '\0';
+	return s;
+}
+
+/** Read RPC call made with GET /rpc/<method>?<name>=<value>&...
+ * All parameters are strings, see generic_fw() for conversion. */
+static bool readhttp_get(struct req *req, char *uri)
+{
+	char *query, *pair, *val, *save;
+
+	query = strchr(uri, '?');
+	if (query) *query++ = '\0';
+
+	req->method = urldecode(uri);
+	req->params = ut_new_thash(NULL, req);
+	req->http.get = true;
+
+	for (pair = query ? strtok_r(query, "&", &save) : NULL; pair; pair = strtok_r(NULL, "&", &save)) {
+		val = strchr(pair, '=');
+		if (val) *val++ = '\0';
+
+		uth_set_char(req->params, urldecode(pair), val ? urldecode(val) : "");
+	}
+
+	return true;
+}
+
 bool readhttp(struct req *req)
 {
 	enum http_type ht;
-	char first[256], buf[BUFSIZ], *ct, *cl, *ac, *uri, *auth;
-	int len;
-	xstr *xs = xstr_create("", req);
+	enum rpc_format fmt;
+	const char *ct, *cl, *ac, *auth, *cc;
+	char *first, *uri;
+	int len, i;
+
+	/* wait for the query and its headers at most O.http.idle seconds, see idle() in daemon.c;
+	 * a read broken by the alarm fails with EINTR and we exit() as on eof */
+	if (O.http.idle > 0)
+		alarm(O.http.idle);
 
 	/* read query */
-	if (!fgets(first, sizeof(first), stdin) || first[0] == '\n')
+	headsize = 0;
+	len = headline(0);
+	if (len == -1 || len == 0)
 		exit(0); /* eof */
 
+	O.http.requests++;
+	timing_start(req);
+
+	if (len < 0) {
+		alarm(0);
+		req->last = true;
+		return errmsg("Invalid HTTP request line");
+	}
+
+	/* read headers */
+	first = head;
+	i = headers(req, len + 1);
+	alarm(0);
+	req->insize = headsize;
+
+	if (!i) {
+		req->last = true;
+		return false;
+	}
+
 	if (strncmp(first, "POST ", 5) == 0) {
 		ht = POST;
 		uri = first + 5;
 	} else if (strncmp(first, "OPTIONS ", 8) == 0) {
 		ht = OPTIONS;
 		uri = first + 8;
+	} else if (strncmp(first, "GET ", 4) == 0 && req->http.upgrade &&
+			strcasecmp(req->http.upgrade, "websocket") == 0) {
+		ht = UPGRADE;
+		uri = first + 4;
+	} else if (strncmp(first, "GET /rpc/", 9) == 0) {
+		ht = GETRPC;
+		uri = first + 9;
 	} else if (strncmp(first, "GET ", 4) == 0 && O.http.htdocs) { /* @1 */
 		ht = GET;
 		uri = first + 4;
@@ -138,16 +486,8 @@ bool readhttp(struct req *req)
 		return errmsg("Invalid HTTP method");
 	}
 
-	/* read headers */
-	while (fgets(buf, sizeof(buf), stdin)) {
-		if (!buf[0] || buf[0] == '\n' || buf[0] == '\r') break;
-		xstr_append(xs, buf);
-	}
-
-	req->http.headers = rfc822_parse(xstr_string(xs), req);
-
 	/* fetch authentication information ASAP */
-	auth = thash_get(req->http.headers, "Authorization");
+	auth = req->http.authorization;
 	if (auth && strncmp(auth, "Basic ", 6) == 0) {
 		xstr *ad = asn_b64_dec(auth+6, req);
 		char *pass = strchr(xstr_string(ad), ':');
@@ -159,13 +499,38 @@ bool readhttp(struct req *req)
 		}
 	}
 
-	const char *cc = thash_get(req->http.headers, "Connection");
-	if (cc && (streq(cc, "close") || streq(cc, "Close")))
+	cc = req->http.connection;
+	if (cc && strcasecmp(cc, "close") == 0)
 		req->last = true;
 
 	if (ht == OPTIONS)
 		return errcode(JSON_RPC_HTTP_OPTIONS);
 
+	/* switch to WebSocket, authenticating the connection once - see writehttp() */
+	if (ht == UPGRADE) {
+		if (!req->http.ws_key)
+			return errmsg("Sec-WebSocket-Key needed");
+		if (!req->http.ws_version || !streq(req->http.ws_version, "13"))
+			return errmsg("Unsupported WebSocket version");
+
+		req->http.needauth = true;
+		return errcode(JSON_RPC_HTTP_UPGRADE);
+	}
+
+	/* cacheable RPC call */
+	if (ht == GETRPC) {
+		char *space = strchr(uri, ' ');
+		if (space) *space = '\0';
+
+		ac = req->http.accept;
+		i = accept_format(ac ? ac : "application/json", FMT_JSON);
+		if (i < 0)
+			return errmsg("Unsupported Accept");
+		req->format = i;
+
+		return readhttp_get(req, uri);
+	}
+
 	/* handle static query, note that htdocs!=NULL checked @1 */
 	if (ht == GET) {
 		req->http.needauth = true;
@@ -196,23 +561,181 @@ bool readhttp(struct req *req)
 
 	/* = POST - ie. normal RPC call = */
 
-	ct = thash_get(req->http.headers, "Content-Type");
+	ct = req->http.content_type;
 	if (!ct) return errmsg("Content-Type needed");
-	if (strncmp(ct, "application/json", 16) != 0)
+	if (strncmp(ct, "application/json", 16) == 0)
+		fmt = FMT_JSON;
+	else if (strncmp(ct, "application/msgpack", 19) == 0 || strncmp(ct, "application/x-msgpack", 21) == 0)
+		fmt = FMT_MSGPACK;
+	else if (strncmp(ct, "application/cbor", 16) == 0)
+		fmt = FMT_CBOR;
+	else
 		return errmsg("Unsupported Content-Type");
 
-	ac = thash_get(req->http.headers, "Accept");
+	ac = req->http.accept;
 	if (!ac) return errmsg("Accept needed");
-	if (!strstr(ac, "application/json") && !strstr(ac, "*/*"))
+
+	i = accept_format(ac, fmt);
+	if (i < 0)
 		return errmsg("Unsupported Accept");
+	req->format = i;
 
 	/* read the query */
-	cl = thash_get(req->http.headers, "Content-Length");
+	cl = req->http.content_length;
 	if (!cl) return errmsg("Content-Length needed");
 
 	len = atoi(cl);
 	if (len < 0)
 		return errmsg("Unsupported Content-Length");
 
-	return readjson_len(req, len);
+	/* the body gets its own O.http.idle seconds too */
+	if (O.http.idle > 0)
+		alarm(O.http.idle);
+
+	if (fmt != FMT_JSON)
+		i = readbinary_len(req, len, fmt);
+	else
+		i = readjson_len(req, len);
+
+	alarm(0);
+
+	/* body read broken by idle(), treat as eof */
+	if (ferror(stdin))
+		exit(0);
+
+	return i;
+}
+
+/** Close WebSocket connection with given status code and exit */
+static void ws_close(int code)
+{
+	char payload[2] = { code >> 8, code & 0xff };
+
+	writews_frame(WS_CLOSE, payload, sizeof payload);
+	exit(0);
+}
+
+/** Read exactly len bytes */
+static void ws_read(void *buf, size_t len)
+{
+	if (len > 0 && fread(buf, 1, len, stdin) != len)
+		exit(0); /* eof */
+}
+
+bool readws(struct req *req)
+{
+	unsigned char hdr[2], ext[8], mask[4];
+	enum ws_opcode op, msgop = WS_CONT;
+	xstr *xs = xstr_create("", req);
+	uint64_t len, i;
+	char *buf;
+	bool fin;
+
+	/* control frames may come in between fragments of a message */
+	for (;;) {
+		ws_read(hdr, 2);
+		fin = hdr[0] & 0x80;
+		op = hdr[0] & 0x0f;
+
+		/* no extensions negotiated, so no reserved bits; clients must mask */
+		if ((hdr[0] & 0x70) || !(hdr[1] & 0x80))
+			ws_close(WS_CLOSE_PROTOCOL);
+
+		len = hdr[1] & 0x7f;
+		if (len == 126) {
+			ws_read(ext, 2);
+			len = ext[0] << 8 | ext[1];
+			req->insize += 2;
+		} else if (len == 127) {
+			ws_read(ext, 8);
+			for (len = 0, i = 0; i < 8; i++)
+				len = len << 8 | ext[i];
+			req->insize += 8;
+		}
+
+		if ((op & 0x8) && (!fin || len > 125))
+			ws_close(WS_CLOSE_PROTOCOL);
+
+		if (len > WS_MESSAGE_MAX - xstr_length(xs))
+			ws_close(WS_CLOSE_TOOBIG);
+
+		ws_read(mask, 4);
+		buf = mmatic_alloc(len + 1, req);
+		ws_read(buf, len);
+		for (i = 0; i < len; i++)
+			buf[i] ^= mask[i & 3];
+		req->insize += 6 + len;
+
+		switch (op) {
+			case WS_CLOSE:
+				ws_close(len >= 2 ? ((unsigned char) buf[0] << 8 | (unsigned char) buf[1]) : WS_CLOSE_NORMAL);
+				break;
+
+			case WS_PING:
+				writews_frame(WS_PONG, buf, len);
+				continue;
+
+			case WS_PONG:
+				continue;
+
+			case WS_CONT:
+				if (msgop == WS_CONT)
+					ws_close(WS_CLOSE_PROTOCOL);
+				break;
+
+			case WS_TEXT:
+			case WS_BINARY:
+				if (msgop != WS_CONT)
+					ws_close(WS_CLOSE_PROTOCOL);
+
+				msgop = op;
+				timing_start(req);
+				break;
+
+			default:
+				ws_close(WS_CLOSE_PROTOCOL);
+		}
+
+		xstr_append_size(xs, buf, len);
+		if (fin)
+			break;
+	}
+
+	/* authenticated once, on upgrade */
+	req->user = req->http.user = O.http.user;
+	req->pass = req->http.pass = O.http.pass;
+
+	if (msgop == WS_BINARY) {
+		req->format = FMT_MSGPACK;
+		req->params = binary_parse(FMT_MSGPACK, xstr_string(xs), xstr_length(xs), req);
+		return common(req, false);
+	}
+
+	req->format = FMT_JSON;
+	return parsejson(req, xs);
+}
+
+bool read_pending(void)
+{
+	int fl = fcntl(0, F_GETFL), c;
+
+	if (fl == -1 || fcntl(0, F_SETFL, fl | O_NONBLOCK) == -1)
+		return false;
+
+	/* served from stdio buffer if it holds more, eg. pipelined requests - else tries the fd */
+	c = getc(stdin);
+	fcntl(0, F_SETFL, fl);
+
+	if (c != EOF) {
+		ungetc(c, stdin);
+		return true;
+	}
+
+	/* let the reader see eof */
+	if (feof(stdin))
+		return true;
+
+	/* EAGAIN: nothing yet */
+	clearerr(stdin);
+	return false;
 }
@@ -9,6 +9,9 @@
 /** Read req->args from stdin in JSON-RPC format */
 bool readjson(struct req *req);
 
+/** Read req->args from stdin in JSON-RPC format encoded as O.format (MessagePack or CBOR) */
+bool readbinary(struct req *req);
+
 /** Read req->args from stdin in rfc822 format */
 bool read822(struct req *req);
 
@@ -16,4 +19,12 @@ bool read822(struct req *req);
  * @note http://groups.google.com/group/json-rpc/web/json-rpc-over-http */
 bool readhttp(struct req *req);
 
+/** Read req->args from stdin as WebSocket message, after upgrade in readhttp()
+ * Text messages are JSON-RPC, binary messages are JSON-RPC encoded as MessagePack. */
+bool readws(struct req *req);
+
+/** Check without blocking if next request is waiting on input, read or not yet
+ * @note true on eof too, so that the reader gets to see it */
+bool read_pending(void);
+
 #endif
@@ -0,0 +1,175 @@
+/*
+ * Traffic capture
+ *
+ * Requests are written as read, before any handling, so a capture can be replayed against another
+ * rpcd instance with rpcd-replay. One line per request, in a single write() so that all rpcd
+ * processes can append to the same file:
+ *
+ *   <unix time in us> <HTTP Basic credentials, or -> <JSON-RPC request>
+ *
+ * Redacted params are replaced with "***" - only top-level members of named params are looked at.
+ *
+ * Copyright (C) 2009-2010 Pawel Foremski <pawel@foremski.pl>
+ *
+ * Licensed under GPLv3
+ */
+
+#define _GNU_SOURCE 1
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include "common.h"
+
+#define RECORD_REDACTED "\"***\""
+
+static struct {
+	int fd;                            /** capture file */
+	thash *redact;                     /** names of params to hide */
+	bool nopass;                       /** if true, do not record HTTP credentials */
+} R = { .fd = -1 };
+
+bool record_init(const char *path, const char *redact)
+{
+	char *names, *name, *save;
+
+	R.fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	if (R.fd == -1) {
+		dbg(0, "%s: could not open capture file: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	if (!redact)
+		return true;
+
+	R.redact = thash_create_strkey(NULL, mmatic_create());
+	names = mmatic_strdup(redact, R.redact);
+
+	for (name = strtok_r(names, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+		if (streq(name, "http.pass"))
+			R.nopass = true;
+		else
+			thash_set(R.redact, name, name);
+	}
+
+	return true;
+}
+
+/** Check if params to record include a redacted member */
+static bool needs_redact(struct req *req)
+{
+	const char *k;
+	ut *v;
+
+	if (!R.redact || thash_count(R.redact) == 0)
+		return false;
+
+	if (req->lazy) {
+		THASH_ITER_LOOP(R.redact, k, v) {
+			if (fastjson_lazy_member(req->lazy, k))
+				return true;
+		}
+
+		return false;
+	}
+
+	if (!ut_is_thash(req->params))
+		return false;
+
+	THASH_ITER_LOOP(R.redact, k, v) {
+		if (uth_get(req->params, k))
+			return true;
+	}
+
+	return false;
+}
+
+/** Print params of req, with redacted members hidden */
+static void print_params(struct req *req, xstr *xs)
+{
+	json *js = json_create(req);
+	bool first = true;
+	const char *k;
+	ut *v;
+
+	/* common case: copy the raw text, without parsing */
+	if (!needs_redact(req)) {
+		if (req->lazy)
+			xstr_append_size(xs, req->lazy->txt, req->lazy->len);
+		else
+			xstr_append(xs, json_print(js, req->params));
+		return;
+	}
+
+	/* parse all params now - it would happen in call() anyway */
+	if (!rpcd_params(req)) {
+		xstr_append(xs, "null");
+		return;
+	}
+
+	xstr_append(xs, "{");
+	THASH_ITER_LOOP(ut_thash(req->params), k, v) {
+		if (!first) xstr_append(xs, ",");
+		xstr_append(xs, json_print(js, ut_new_char(k, req)));
+		xstr_append(xs, ":");
+		xstr_append(xs, thash_get(R.redact, k) ? RECORD_REDACTED : json_print(js, v));
+		first = false;
+	}
+	xstr_append(xs, "}");
+}
+
+void record_add(struct req *req)
+{
+	const char *auth = req->http.authorization;
+	json *js = json_create(req);
+	struct timespec ts;
+	char *line, *p;
+	xstr *xs;
+
+	/* nothing to replay */
+	if (R.fd == -1 || !ut_ok(req->reply) || !req->method)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	if (R.nopass || !auth || strncmp(auth, "Basic ", 6) != 0)
+		auth = "-";
+	else
+		auth += 6;
+
+	xs = xstr_create("", req);
+	xstr_append(xs, mmatic_printf(req, "%lld %s {",
+		ts.tv_sec * 1000000LL + ts.tv_nsec / 1000, auth));
+
+	/* the version is not kept after read.c, but it is what makes a notification */
+	if (req->notify)
+		xstr_append(xs, "\"jsonrpc\":\"2.0\",");
+
+	if (req->service)
+		xstr_append(xs, mmatic_printf(req, "\"service\":%s,",
+			json_print(js, ut_new_char(req->service, req))));
+
+	xstr_append(xs, mmatic_printf(req, "\"method\":%s,",
+		json_print(js, ut_new_char(req->method, req))));
+
+	if (req->id)
+		xstr_append(xs, mmatic_printf(req, "\"id\":%s,",
+			json_print(js, ut_new_char(req->id, req))));
+
+	xstr_append(xs, "\"params\":");
+	print_params(req, xs);
+	xstr_append(xs, "}");
+
+	/* raw (CR)LFs in JSON text can only be whitespace - keep one request per line */
+	line = xstr_string(xs);
+	for (p = line; (p = strpbrk(p, "\r\n")); p++)
+		*p = ' ';
+
+	xstr_append(xs, "\n");
+	if (write(R.fd, xstr_string(xs), xstr_length(xs)) != xstr_length(xs))
+		dbg(1, "capture: write failed: %s\n", strerror(errno));
+}
+
+/* for Vim autocompletion:
+ * vim: path=.,/usr/include,/usr/local/include,~/local/include
+ */
@@ -0,0 +1,22 @@
+/*
+ * Traffic capture for rpcd-replay, see record.c
+ *
+ * Copyright (C) 2009-2010 Pawel Foremski <pawel@foremski.pl>
+ *
+ * Licensed under GPLv3
+ */
+
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+/** Open capture file
+ * @param path    capture file, appended to - may be shared by many rpcd processes
+ * @param redact  comma-separated names of params to hide, "http.pass" hides HTTP credentials;
+ *                may be NULL
+ * @retval false  failed */
+bool record_init(const char *path, const char *redact);
+
+/** Append request just read to the capture file, unless capture is disabled */
+void record_add(struct req *req);
+
+#endif
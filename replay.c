@@ -0,0 +1,552 @@
+/*
+ * rpcd-replay: send traffic captured with rpcd --record back to an rpcd instance
+ *
+ * Requests are replayed at the recorded pace (optionally scaled), or as fast as possible, over a
+ * number of parallel kept-alive connections. At the end, latency percentiles are reported.
+ *
+ * When pacing, latency is measured from the time the request was due, not from when it was
+ * actually sent - if the server (or a too low --conns) makes requests queue up, it shows.
+ *
+ * Copyright (C) 2009-2010 Pawel Foremski <pawel@foremski.pl>
+ *
+ * Licensed under GPLv3
+ */
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define REPLAY_BUF 65536               /** initial reply buffer size */
+
+struct rec {
+	long long time;                    /** capture time, in us */
+	const char *auth;                  /** HTTP Basic credentials, may be NULL */
+	const char *body;                  /** JSON-RPC request */
+	size_t len;                        /** length of body */
+	int seq;                           /** position in file, for stable sorting */
+	long long latency;                 /** result: latency in us, -1 on failure */
+	bool error;                        /** result: reply was an error */
+	bool notify;                       /** JSON-RPC 2.0 notification - no reply will come */
+};
+
+/** Options */
+static struct {
+	double speed;                      /** pace multiplier, 0 means as fast as possible */
+	int conns;                         /** number of connections */
+	const char *auth;                  /** if not NULL, credentials to use for all requests */
+	const char *path;                  /** HTTP request path */
+	bool json;                         /** if true, use plain JSON-RPC instead of HTTP */
+	const char *host;
+	const char *port;
+} O;
+
+static struct rec *recs;
+static int count;
+static int next;                       /** next record to send */
+static long long start;                /** replay start time, in us */
+
+/** Microseconds since some point in the past */
+static long long usnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void help(void)
+{
+	printf("Usage: rpcd-replay [OPTIONS] <CAPTURE FILE> <HOST>:<PORT>\n");
+	printf("\n");
+	printf("  Replay traffic captured with rpcd --record.\n");
+	printf("\n");
+	printf("Options:\n");
+	printf("  --speed=<x>            replay <x> times faster than recorded, 0 means at full speed [1]\n");
+	printf("  --conns=<n>            use <n> parallel connections [8]\n");
+	printf("  --auth=<user:pass>     use these HTTP credentials, eg. for captures without passwords\n");
+	printf("  --path=<uri>           HTTP request path [/]\n");
+	printf("  --json                 speak plain JSON-RPC, eg. to rpcd --json run from inetd\n");
+	printf("  --help,-h              show this help screen\n");
+}
+
+static const char *base64(const char *src)
+{
+	static const char tab[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t len = strlen(src), i;
+	char *dst = malloc(len / 3 * 4 + 5), *p = dst;
+	const unsigned char *s = (const unsigned char *) src;
+
+	for (i = 0; i + 2 < len; i += 3) {
+		*p++ = tab[s[i] >> 2];
+		*p++ = tab[((s[i] & 3) << 4) | (s[i + 1] >> 4)];
+		*p++ = tab[((s[i + 1] & 15) << 2) | (s[i + 2] >> 6)];
+		*p++ = tab[s[i + 2] & 63];
+	}
+
+	if (i < len) {
+		*p++ = tab[s[i] >> 2];
+		if (i + 1 < len) {
+			*p++ = tab[((s[i] & 3) << 4) | (s[i + 1] >> 4)];
+			*p++ = tab[(s[i + 1] & 15) << 2];
+		} else {
+			*p++ = tab[(s[i] & 3) << 4];
+			*p++ = '=';
+		}
+		*p++ = '=';
+	}
+
+	*p = '\0';
+	return dst;
+}
+
+/** @return 0 on success, 1 on error, 2 on help */
+static int parse_argv(int argc, char *argv[])
+{
+	char *colon;
+	int c;
+
+	static struct option long_opts[] = {
+		{ "speed",      1, NULL,  1  },
+		{ "conns",      1, NULL,  2  },
+		{ "auth",       1, NULL,  3  },
+		{ "path",       1, NULL,  4  },
+		{ "json",       0, NULL,  5  },
+		{ "help",       0, NULL,  'h' },
+		{ 0, 0, 0, 0 }
+	};
+
+	O.speed = 1.0;
+	O.conns = 8;
+	O.path = "/";
+
+	for (;;) {
+		c = getopt_long(argc, argv, "h", long_opts, NULL);
+		if (c == -1) break;
+
+		switch (c) {
+			case 1: O.speed = atof(optarg); break;
+			case 2: O.conns = atoi(optarg); break;
+			case 3: O.auth = base64(optarg); break;
+			case 4: O.path = optarg; break;
+			case 5: O.json = true; break;
+			case 'h': help(); return 2;
+			default: help(); return 1;
+		}
+	}
+
+	if (argc - optind != 2 || O.conns < 1 || O.speed < 0) {
+		help();
+		return 1;
+	}
+
+	O.host = argv[optind + 1];
+	colon = strrchr(O.host, ':');
+	if (!colon) {
+		fprintf(stderr, "%s: no port given\n", O.host);
+		return 1;
+	}
+
+	*colon = '\0';
+	O.port = colon + 1;
+	return 0;
+}
+
+static int cmp(const void *a, const void *b)
+{
+	const struct rec *ra = a, *rb = b;
+
+	if (ra->time != rb->time)
+		return ra->time < rb->time ? -1 : 1;
+	else
+		return ra->seq - rb->seq;
+}
+
+/** Check if captured request is a notification: version 2.0 and no id
+ * @note relies on rpcd --record writing params last */
+static bool notification(const char *body)
+{
+	const char *params = strstr(body, "\"params\":");
+	const char *id = strstr(body, "\"id\":");
+
+	if (!strstr(body, "\"jsonrpc\":\"2.0\""))
+		return false;
+
+	return !id || (params && id > params);
+}
+
+/** Read capture file
+ * @retval false  failed */
+static bool load(const char *path)
+{
+	FILE *fp;
+	char *line = NULL, *auth, *body, *end;
+	size_t size = 0;
+	ssize_t len;
+	int alloc = 0, lineno = 0;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	while ((len = getline(&line, &size, fp)) != -1) {
+		lineno++;
+
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+
+		/* <time> <auth> <body> */
+		auth = strchr(line, ' ');
+		body = auth ? strchr(auth + 1, ' ') : NULL;
+		if (!body) {
+			fprintf(stderr, "%s:%d: invalid record, skipping\n", path, lineno);
+			continue;
+		}
+
+		*auth++ = '\0';
+		*body++ = '\0';
+
+		if (count == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			recs = realloc(recs, alloc * sizeof *recs);
+		}
+
+		recs[count].time = strtoll(line, &end, 10);
+		recs[count].auth = O.auth ? O.auth : (strcmp(auth, "-") == 0 ? NULL : strdup(auth));
+		recs[count].body = strdup(body);
+		recs[count].len = strlen(body);
+		recs[count].seq = count;
+		recs[count].latency = -1;
+		recs[count].error = false;
+		recs[count].notify = notification(body);
+		count++;
+	}
+
+	free(line);
+	fclose(fp);
+
+	/* many rpcd processes append to the capture, so it is only roughly in order */
+	qsort(recs, count, sizeof *recs, cmp);
+	return true;
+}
+
+static int dial(void)
+{
+	struct addrinfo hints, *res, *ai;
+	int fd = -1, one = 1, r;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if ((r = getaddrinfo(O.host, O.port, &hints, &res)) != 0) {
+		fprintf(stderr, "%s: %s\n", O.host, gai_strerror(r));
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd == -1)
+			continue;
+
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+
+	if (fd >= 0)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+	return fd;
+}
+
+static bool sendall(int fd, const char *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		r = send(fd, buf, len, MSG_NOSIGNAL);
+		if (r == -1) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+
+		buf += r;
+		len -= r;
+	}
+
+	return true;
+}
+
+/** Reply buffer of one connection */
+struct conn {
+	int fd;
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+/** Read more of the reply
+ * @retval false  connection closed or failed */
+static bool fill(struct conn *c)
+{
+	ssize_t r;
+
+	if (c->len + 1 >= c->size) {
+		c->size *= 2;
+		c->buf = realloc(c->buf, c->size);
+	}
+
+	do {
+		r = recv(c->fd, c->buf + c->len, c->size - c->len - 1, 0);
+	} while (r == -1 && errno == EINTR);
+
+	if (r <= 0)
+		return false;
+
+	c->len += r;
+	c->buf[c->len] = '\0';
+	return true;
+}
+
+/** Find the blank line ending HTTP head, or JSON reply - rpcd uses plain LFs
+ * @return length including the blank line, 0 if not found yet */
+static size_t blank(struct conn *c)
+{
+	char *p;
+
+	if ((p = strstr(c->buf, "\n\n")))
+		return p - c->buf + 2;
+	else if ((p = strstr(c->buf, "\r\n\r\n")))
+		return p - c->buf + 4;
+	else
+		return 0;
+}
+
+/** Send one request and wait for the reply
+ * @param keep    set to false if the server is closing the connection
+ * @retval false  failed */
+static bool exchange(struct conn *c, struct rec *r, bool *keep)
+{
+	char head[1024], *p;
+	size_t hlen, blen = 0;
+	int hl, status;
+	bool ok;
+
+	if (O.json) {
+		ok = sendall(c->fd, r->body, r->len) && sendall(c->fd, "\n\n", 2);
+	} else {
+		hl = snprintf(head, sizeof head,
+			"POST %s HTTP/1.1\r\n"
+			"Host: %s\r\n"
+			"Content-Type: application/json-rpc\r\n"
+			"Accept: application/json\r\n"
+			"Content-Length: %u\r\n"
+			"%s%s%s"
+			"\r\n",
+			O.path, O.host, (unsigned int) r->len,
+			r->auth ? "Authorization: Basic " : "", r->auth ? r->auth : "", r->auth ? "\r\n" : "");
+
+		ok = sendall(c->fd, head, hl) && sendall(c->fd, r->body, r->len);
+	}
+
+	if (!ok)
+		return false;
+
+	/* rpcd writes nothing back in plain JSON-RPC */
+	if (O.json && r->notify)
+		return true;
+
+	c->len = 0;
+	c->buf[0] = '\0';
+
+	while (!(hlen = blank(c))) {
+		if (!fill(c))
+			return false;
+	}
+
+	if (O.json) {
+		r->error = (strstr(c->buf, "\"error\":") != NULL);
+		return true;
+	}
+
+	/* HTTP: status line, Content-Length and Connection */
+	if (sscanf(c->buf, "HTTP/1.%*d %d", &status) != 1)
+		return false;
+
+	for (p = strchr(c->buf, '\n'); p && (size_t) (p - c->buf) < hlen; p = strchr(p, '\n')) {
+		p++;
+
+		if (strncasecmp(p, "Content-Length:", 15) == 0)
+			blen = strtoul(p + 15, NULL, 10);
+		else if (strncasecmp(p, "Connection:", 11) == 0 && strncasecmp(p + 11, " close", 6) == 0)
+			*keep = false;
+	}
+
+	while (c->len < hlen + blen) {
+		if (!fill(c))
+			return false;
+	}
+
+	r->error = ((status != 200 && status != 204) || strstr(c->buf + hlen, "\"error\":") != NULL);
+	return true;
+}
+
+static void *worker(void *arg)
+{
+	struct conn c = { -1, malloc(REPLAY_BUF), REPLAY_BUF, 0 };
+	struct timespec ts;
+	struct rec *r;
+	long long due, now;
+	int i, tries;
+	bool keep;
+
+	while ((i = __sync_fetch_and_add(&next, 1)) < count) {
+		r = &recs[i];
+
+		/* wait until the request is due */
+		if (O.speed > 0) {
+			due = start + (r->time - recs[0].time) / O.speed;
+			now = usnow();
+
+			if (due > now) {
+				ts.tv_sec = due / 1000000;
+				ts.tv_nsec = (due % 1000000) * 1000;
+				while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+			}
+		} else {
+			due = usnow();
+		}
+
+		/* server may have closed an idle connection meanwhile - try again once on a new one */
+		for (tries = (c.fd == -1) ? 1 : 2; tries > 0; tries--) {
+			if (c.fd == -1 && (c.fd = dial()) == -1)
+				break;
+
+			keep = true;
+			if (exchange(&c, r, &keep))
+				r->latency = usnow() - due;
+			else
+				keep = false;
+
+			if (!keep) {
+				close(c.fd);
+				c.fd = -1;
+			}
+
+			if (r->latency >= 0)
+				break;
+		}
+	}
+
+	if (c.fd != -1)
+		close(c.fd);
+
+	free(c.buf);
+	return NULL;
+}
+
+static int cmpll(const void *a, const void *b)
+{
+	long long x = *(const long long *) a, y = *(const long long *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void report(long long took)
+{
+	long long *lat = malloc((count + 1) * sizeof *lat);
+	static const double pct[] = { 50, 90, 99, 99.9 };
+	int i, n = 0, failed = 0, errors = 0;
+
+	for (i = 0; i < count; i++) {
+		if (recs[i].latency < 0)
+			failed++;
+		else
+			lat[n++] = recs[i].latency;
+
+		if (recs[i].error)
+			errors++;
+	}
+
+	printf("requests %d, failed %d, errors %d, %.3fs, %.1f req/s\n",
+		count, failed, errors, took / 1e6, took > 0 ? n * 1e6 / took : 0.0);
+
+	/* errors are cheap, so latencies of such a run say little about the real thing */
+	if (n > 0 && errors * 2 > n)
+		fprintf(stderr, "warning: most replies were errors - check the server config, --path and --auth\n");
+
+	if (n == 0) {
+		free(lat);
+		return;
+	}
+
+	qsort(lat, n, sizeof *lat, cmpll);
+
+	printf("latency (ms): min %.3f", lat[0] / 1e3);
+	for (i = 0; i < (int) (sizeof pct / sizeof pct[0]); i++)
+		printf(" p%g %.3f", pct[i], lat[(int) ((n - 1) * pct[i] / 100)] / 1e3);
+	printf(" max %.3f\n", lat[n - 1] / 1e3);
+
+	free(lat);
+}
+
+int main(int argc, char *argv[])
+{
+	pthread_t *tids;
+	int i;
+
+	switch (parse_argv(argc, argv)) {
+		case 1: return 1;
+		case 2: return 0;
+	}
+
+	if (!load(argv[optind]))
+		return 2;
+
+	if (count == 0) {
+		fprintf(stderr, "%s: no requests\n", argv[optind]);
+		return 2;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	tids = malloc(O.conns * sizeof *tids);
+	start = usnow();
+
+	for (i = 0; i < O.conns; i++) {
+		if (pthread_create(&tids[i], NULL, worker, NULL) != 0) {
+			fprintf(stderr, "could not start thread\n");
+			return 3;
+		}
+	}
+
+	for (i = 0; i < O.conns; i++)
+		pthread_join(tids[i], NULL);
+
+	report(usnow() - start);
+	return 0;
+}
+
+/* for Vim autocompletion:
+ * vim: path=.,/usr/include,/usr/local/include,~/local/include
+ */
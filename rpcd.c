@@ -11,9 +11,222 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
 #include <libpjf/lib.h>
 #include "common.h"
 
+#define SCAN_THREADS_MAX 16            /** max number of directory scanning threads */
+#define INIT_SLOW 0.05                 /** report module init() taking this many seconds or more */
+#define WATCHDOG_REUSE 60              /** max age of timeout reply prepared for earlier call, in s */
+#define SNAPSHOT_MAGIC "rpcd-snapshot-1"
+
+/** Directory contents, read by scan threads */
+struct listing {
+	const char *path;                  /** directory path */
+	char **files;                      /** sorted file names, malloc()ed */
+	int count;                         /** number of files */
+};
+
+/** Work shared between scan threads */
+struct scanjob {
+	struct listing *listings;
+	int count;
+	int next;                          /** next listing to take, updated atomically */
+};
+
+/** Monotonic time in seconds */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int strpcmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/** Read directory and warm up page cache for shared objects in it
+ * @note runs in scan threads - must not use mmatic */
+static void scan_dir(struct listing *ls)
+{
+	DIR *d;
+	struct dirent *de;
+	char path[PATH_MAX];
+	const char *ext;
+	int size = 0, fd;
+
+	d = opendir(ls->path);
+	if (!d)
+		return;
+
+	while ((de = readdir(d))) {
+		if (streq(de->d_name, ".") || streq(de->d_name, ".."))
+			continue;
+
+		if (ls->count == size) {
+			size = size ? size * 2 : 64;
+			ls->files = realloc(ls->files, size * sizeof(char *));
+		}
+		ls->files[ls->count++] = strdup(de->d_name);
+
+		/* dlopen() takes a global lock and js_init() reads the script, but reading from disk can
+		 * be done in parallel */
+		ext = strrchr(de->d_name, '.');
+		if (ext && (streq(ext, ".so") || streq(ext, ".js"))) {
+			snprintf(path, sizeof path, "%s/%s", ls->path, de->d_name);
+			if ((fd = open(path, O_RDONLY)) != -1) {
+				posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+				close(fd);
+			}
+		}
+	}
+
+	closedir(d);
+	qsort(ls->files, ls->count, sizeof(char *), strpcmp);
+}
+
+static void *scan_thread(void *arg)
+{
+	struct scanjob *job = arg;
+	int i;
+
+	while ((i = __sync_fetch_and_add(&job->next, 1)) < job->count)
+		scan_dir(&job->listings[i]);
+
+	return NULL;
+}
+
+/** Scan all directories given in config using a pool of threads
+ * @return thash: dir path => struct listing */
+static thash *scan_dirs(struct rpcd *rpcd, ut *rootcfg)
+{
+	struct scanjob job = { NULL, 0, 0 };
+	pthread_t threads[SCAN_THREADS_MAX];
+	const char *svcname, *dirpath;
+	ut *svccfg, *dircfg;
+	thash *ret;
+	int i, n;
+
+	/* count, then fill */
+	for (n = 0; n < 2; n++) {
+		THASH_ITER_LOOP(ut_thash(rootcfg), svcname, svccfg) {
+			if (streq(svcname, "*") || !ut_is_thash(svccfg))
+				continue;
+
+			THASH_ITER_LOOP(ut_thash(svccfg), dirpath, dircfg) {
+				if (streq(dirpath, "*"))
+					continue;
+
+				if (job.listings)
+					job.listings[job.next++] = (struct listing) { dirpath, NULL, 0 };
+				else
+					job.count++;
+			}
+		}
+
+		if (n == 0)
+			job.listings = mmatic_zalloc(MAX(job.count, 1) * sizeof *job.listings, rpcd);
+	}
+
+	job.next = 0;
+
+	n = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1), MIN(SCAN_THREADS_MAX, job.count));
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&threads[i], NULL, scan_thread, &job) != 0)
+			break;
+	}
+
+	/* also help, in case no thread could be started */
+	scan_thread(&job);
+
+	while (--i >= 0)
+		pthread_join(threads[i], NULL);
+
+	ret = thash_create_strkey(NULL, rpcd);
+	for (i = 0; i < job.count; i++)
+		thash_set(ret, job.listings[i].path, &job.listings[i]);
+
+	return ret;
+}
+
+/** Free memory taken by listings */
+static void scan_free(thash *listings)
+{
+	struct listing *ls;
+	const char *path;
+	int i;
+
+	THASH_ITER_LOOP(listings, path, ls) {
+		for (i = 0; i < ls->count; i++)
+			free(ls->files[i]);
+		free(ls->files);
+	}
+}
+
+/** Read config snapshot written by snapshot_write()
+ * @param stamp   description of config source, must match the one in snapshot
+ * @retval NULL   snapshot missing or stale */
+static ut *snapshot_read(struct rpcd *rpcd, const char *snapshot, const char *stamp)
+{
+	FILE *fp;
+	char buf[BUFSIZ];
+	ut *cfg = NULL;
+
+	fp = fopen(snapshot, "r");
+	if (!fp)
+		return NULL;
+
+	if (fgets(buf, sizeof buf, fp) && streq(asn_trim(buf), SNAPSHOT_MAGIC) &&
+		fgets(buf, sizeof buf, fp) && streq(asn_trim(buf), stamp)) {
+		cfg = binary_read(FMT_MSGPACK, fp, rpcd);
+
+		if (cfg && (!ut_ok(cfg) || !ut_is_thash(cfg))) {
+			dbg(1, "%s: invalid snapshot, ignoring\n", snapshot);
+			cfg = NULL;
+		}
+	}
+
+	fclose(fp);
+	return cfg;
+}
+
+/** Write config snapshot, atomically replacing the old one */
+static void snapshot_write(struct rpcd *rpcd, const char *snapshot, const char *stamp, ut *cfg)
+{
+	FILE *fp;
+	xstr *xs;
+	char *tmp;
+
+	tmp = mmatic_printf(rpcd, "%s.%d", snapshot, (int) getpid());
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		dbg(1, "%s: fopen() failed: %s\n", tmp, strerror(errno));
+		return;
+	}
+
+	xs = binary_print(FMT_MSGPACK, cfg, rpcd);
+	fprintf(fp, "%s\n%s\n", SNAPSHOT_MAGIC, stamp);
+	fwrite(xstr_string(xs), 1, xstr_length(xs), fp);
+
+	if (fclose(fp) != 0 || rename(tmp, snapshot) != 0) {
+		dbg(1, "%s: writing snapshot failed: %s\n", snapshot, strerror(errno));
+		unlink(tmp);
+	}
+}
+
 /** Parse config file
  * @retval NULL   failed */
 static ut *read_config(struct rpcd *rpcd, const char *config_file, bool config_inline)
@@ -67,6 +280,107 @@ static ut *read_config(struct rpcd *rpcd, const char *config_file, bool config_i
 	return cfg;
 }
 
+/** Serializes lazy loading and unloading of modules */
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Check module API and fill in defaults
+ * @retval false  invalid API */
+static bool check_api(struct mod *mod)
+{
+	asnsert(mod->api);
+
+	if (mod->api->tag != RPCD_TAG) {
+		dbg(0, "%s failed: invalid API magic\n", mod->path);
+		return false;
+	}
+
+	if (!mod->api->init)
+		mod->api->init = generic_init;
+
+	if (!mod->api->deinit)
+		mod->api->deinit = generic_deinit;
+
+	if (!mod->api->handle)
+		mod->api->handle = generic_handle;
+
+	return true;
+}
+
+/** dlopen() C module and find its API
+ * @return dlopen() handle
+ * @retval NULL   failed */
+static void *load_so(struct mod *mod)
+{
+	void *so = dlopen(mod->path, RTLD_LAZY | RTLD_GLOBAL);
+	if (!so) {
+		dbg(0, "%s failed: %s\n", mod->name, dlerror());
+		return NULL;
+	}
+
+	mod->api = dlsym(so, mmatic_printf(mod, "%s_api", mod->name));
+	if (!mod->api) {
+		dbg(1, "%s: warning - no API found\n", mod->name);
+		mod->api = &generic_api;
+	}
+
+	mod->fw = dlsym(so, mmatic_printf(mod, "%s_fw", mod->name));
+	return so;
+}
+
+/** Start fresh mod->mm and mod->prv for next init() */
+static void load_mm(struct mod *mod)
+{
+	mod->mm  = mmatic_create();
+	mod->prv = ut_new_thash(NULL, mod->mm);
+}
+
+/** Free what init() left in mod->mm, see load_mm() */
+static void unload_mm(struct mod *mod)
+{
+	if (!mod->mm)
+		return;
+
+	mmatic_free(mod->mm);
+	mod->mm  = NULL;
+	mod->prv = NULL;
+}
+
+/** Make sure C module with "lazy = true" is loaded and initialized
+ * @retval false  failed */
+static bool load_lazy(struct mod *mod)
+{
+	void *so;
+
+	mod->used = time(NULL);
+
+	if (mod->type != C || mod->so)
+		return true;
+
+	pthread_mutex_lock(&load_lock);
+
+	if (!mod->so) {
+		if (!mod->mm)
+			load_mm(mod);
+
+		so = load_so(mod);
+
+		if (so && check_api(mod) && mod->api->init(mod)) {
+			dbg(3, "%s: loaded on first call\n", mod->path);
+			__sync_synchronize();
+			mod->so = so;
+		} else {
+			dbg(0, "%s: loading on first call failed\n", mod->path);
+			if (so) dlclose(so);
+			mod->api = NULL;
+			mod->fw = NULL;
+			unload_mm(mod);
+		}
+	}
+
+	pthread_mutex_unlock(&load_lock);
+	return mod->so != NULL;
+}
+
 /** Load given module
  *
  * @param dir       directory containing module file
@@ -77,19 +391,36 @@ static ut *read_config(struct rpcd *rpcd, const char *config_file, bool config_i
 static struct mod *load_module(struct dir *dir, const char *filename, bool *skipflag)
 {
 	struct mod *mod;
-	char *ext;
+	const char *ext, *c;
+	char *name;
 
 	*skipflag = 0;
 
+	/* split filename into name and lowercase extension */
+	ext = strrchr(filename, '.');
+	for (c = ext ? ext + 1 : NULL; c && *c; c++) {
+		if (*c < 'a' || *c > 'z')
+			break;
+	}
+
+	if (!ext || ext[1] == '\0' || *c)
+		ext = "";
+
 	mod = mmatic_zalloc(sizeof *mod, dir);
 	mod->dir  = dir;
-	mod->name = asn_replace("/\\.[a-z]+$/", "", filename, mod);
+	mod->name = name = mmatic_strdup(filename, mod);
+	name[strlen(filename) - strlen(ext)] = '\0';
 	mod->path = mmatic_printf(mod, "%s/%s", dir->path, filename);
 
 	if (asn_isfile(mod->path) < 0)
 		goto skip;
 
-	ext = asn_replace("/.*(\\.[a-z]+)$/", "\\1", filename, mod);
+	load_mm(mod);
+	mod->cfg  = ut_new_thash(NULL, mod);
+	uth_merge(mod->cfg, dir->svc->rpcd->cfg);
+	uth_merge(mod->cfg, dir->svc->cfg);
+	uth_merge(mod->cfg, dir->cfg);
+
 	if (streq(ext, ".sh")) {
 		if (!asn_isexecutable(mod->path)) {
 			dbg(1, "%s: exec bit not set - skipping\n", mod->path);
@@ -101,58 +432,44 @@ static struct mod *load_module(struct dir *dir, const char *filename, bool *skip
 	} else if (streq(ext, ".so")) {
 		mod->type = C;
 
-		void *so = dlopen(mod->path, RTLD_LAZY | RTLD_GLOBAL);
-		if (!so) {
-			dbg(0, "%s failed: %s\n", mod->name, dlerror());
-			return NULL;
+		/* defer to first call, see load_lazy() */
+		if (uth_bool(mod->cfg, "lazy") && !streq(mod->name, "common")) {
+			dbg(1, "found %s\n", mod->path);
+			return mod;
 		}
 
-		mod->api = dlsym(so, mmatic_printf(mod, "%s_api", mod->name));
-		if (!mod->api) {
-			dbg(1, "%s: warning - no API found\n", mod->name);
-			mod->api = &generic_api;
+		mod->so = load_so(mod);
+		if (!mod->so) {
+			unload_mm(mod);
+			return NULL;
 		}
-
-		mod->fw = dlsym(so, mmatic_printf(mod, "%s_fw", mod->name));
 	} else if (streq(ext, ".js")) {
-		dbg(1, "%s: JS not supported yet\n", mod->path);
+#ifdef RPCD_JS
+		mod->type = JS;
+		mod->api = &js_api;
+#else
+		dbg(1, "%s: built without JS support - skipping\n", mod->path);
 		goto skip;
+#endif
 	} else goto skip;
 
-	asnsert(mod->api);
-
-	if (mod->api->tag != RPCD_TAG) {
-		dbg(0, "%s failed: invalid API magic\n", mod->path);
+	if (!check_api(mod))
 		goto skip;
-	}
-
-	if (!mod->api->init)
-		mod->api->init = generic_init;
-
-	if (!mod->api->deinit)
-		mod->api->deinit = generic_deinit;
-
-	if (!mod->api->handle)
-		mod->api->handle = generic_handle;
-
-	mod->prv  = ut_new_thash(NULL, mod);
-	mod->cfg  = ut_new_thash(NULL, mod);
-	uth_merge(mod->cfg, dir->svc->rpcd->cfg);
-	uth_merge(mod->cfg, dir->svc->cfg);
-	uth_merge(mod->cfg, dir->cfg);
 
 	dbg(1, "loaded %s\n", mod->path);
 	return mod;
 
 skip:
+	unload_mm(mod);
 	mmatic_freeptr(mod);
 	*skipflag = 1;
 	return NULL;
 }
 
 /** Load given directory
- * @retval NULL   failed */
-static struct dir *load_dir(struct svc *svc, const char *dirpath, ut *dircfg)
+ * @param listing  directory contents, may be NULL
+ * @retval NULL    failed */
+static struct dir *load_dir(struct svc *svc, const char *dirpath, ut *dircfg, struct listing *listing)
 {
 	struct dir *dir;
 	struct mod *mod;
@@ -162,6 +479,7 @@ static struct dir *load_dir(struct svc *svc, const char *dirpath, ut *dircfg)
 	char *filename;
 	tlist *ls;
 	bool skip;
+	int i;
 
 	dir = mmatic_zalloc(sizeof *dir, svc);
 	dir->svc = svc;
@@ -170,9 +488,16 @@ static struct dir *load_dir(struct svc *svc, const char *dirpath, ut *dircfg)
 	dir->prv = ut_new_thash(NULL, dir);
 	dir->path = asn_abspath(dirpath, dir);
 	dir->modules = thash_create_strkey(NULL, dir);
+	dir->limit = limit_create(dir->path, dir->cfg, dir);
 
-	/* scan directory */
-	ls = asn_ls(dir->path, dir);
+	/* scan directory, unless done already */
+	if (listing) {
+		ls = tlist_create(NULL, dir);
+		for (i = 0; i < listing->count; i++)
+			tlist_push(ls, mmatic_strdup(listing->files[i], dir));
+	} else {
+		ls = asn_ls(dir->path, dir);
+	}
 
 	/* load the common module first */
 	TLIST_ITER_LOOP(ls, filename) {
@@ -212,6 +537,9 @@ static struct dir *load_dir(struct svc *svc, const char *dirpath, ut *dircfg)
 
 		if (mod) {
 			uth_merge(mod->cfg, modcfg);
+
+			/* limits given for this very module, not inherited from dir->cfg */
+			mod->limit = limit_create(mod->path, modcfg, mod);
 		} else {
 			dbg(1, "%s.%s: could not find matching module for key '%s'\n",
 				svc->name, dir->name, modname);
@@ -222,8 +550,9 @@ static struct dir *load_dir(struct svc *svc, const char *dirpath, ut *dircfg)
 }
 
 /** Load given service
- * @retval NULL  failed */
-static struct svc *load_svc(struct rpcd *rpcd, const char *svcname, ut *svccfg)
+ * @param listings  dir path => struct listing, see scan_dirs()
+ * @retval NULL     failed */
+static struct svc *load_svc(struct rpcd *rpcd, const char *svcname, ut *svccfg, thash *listings)
 {
 	struct svc *svc;
 	struct dir *dir;
@@ -243,7 +572,7 @@ static struct svc *load_svc(struct rpcd *rpcd, const char *svcname, ut *svccfg)
 		if (streq(dirpath, "*"))
 			continue;
 
-		dir = load_dir(svc, dirpath, dircfg);
+		dir = load_dir(svc, dirpath, dircfg, thash_get(listings, dirpath));
 
 		if (dir) {
 			thash_set(svc->dirs, asn_basename(dirpath), dir);
@@ -256,31 +585,103 @@ static struct svc *load_svc(struct rpcd *rpcd, const char *svcname, ut *svccfg)
 	return svc;
 }
 
+/** Run init() of mod, reporting slow ones
+ * @retval false   failed */
+static bool init_mod(struct mod *mod)
+{
+	double start = now(), took;
+
+	if (!mod->api->init(mod)) {
+		dbg(0, "%s: module initialization failed\n", mod->path);
+		return false;
+	}
+
+	took = now() - start;
+	if (took >= INIT_SLOW)
+		dbg(1, "%s: init() took %.3fs\n", mod->path, took);
+
+	return true;
+}
+
 /***************************************************************************************************/
 /***************************************************************************************************/
 /***************************************************************************************************/
 
+/** Free mod->mm of all modules - they are not in the mmatic tree of rpcd */
+static void free_mms(struct rpcd *rpcd)
+{
+	const char *svcname, *dirname, *modname;
+	struct svc *svc;
+	struct dir *dir;
+	struct mod *mod;
+
+	if (!rpcd->svcs)
+		return;
+
+	THASH_ITER_LOOP(rpcd->svcs, svcname, svc) {
+		THASH_ITER_LOOP(svc->dirs, dirname, dir) {
+			if (dir->common)
+				unload_mm(dir->common);
+
+			THASH_ITER_LOOP(dir->modules, modname, mod)
+				unload_mm(mod);
+		}
+	}
+}
+
 struct rpcd *rpcd_init(const char *config_file, bool config_inline)
+{
+	return rpcd_init_snapshot(config_file, config_inline, NULL);
+}
+
+struct rpcd *rpcd_init_snapshot(const char *config_file, bool config_inline, const char *snapshot)
 {
 	struct rpcd *rpcd;
-	ut *rootcfg, *svccfg;
-	const char *svcname, *dirname, *modname;
+	ut *rootcfg = NULL, *svccfg;
+	const char *svcname, *dirname, *modname, *stamp = NULL;
 	struct svc *svc;
 	struct dir *dir;
 	struct mod *mod;
-	thash *t;
+	struct stat ss;
+	thash *t, *listings = NULL;
+	double t0, t1, t2, t3, t4;
 
 	rpcd = mmatic_zalloc(sizeof *rpcd, mmatic_create());
+	t0 = now();
+
+	/* use snapshot of parsed config if config file did not change */
+	if (snapshot && !config_inline) {
+		if (!config_file)
+			config_file = RPCD_DEFAULT_CONFIGFILE;
+
+		if (stat(config_file, &ss) == 0) {
+			stamp = mmatic_printf(rpcd, "%s %ld %ld", config_file, (long) ss.st_mtime, (long) ss.st_size);
+			rootcfg = snapshot_read(rpcd, snapshot, stamp);
+
+			if (rootcfg)
+				dbg(3, "%s: using config snapshot\n", snapshot);
+		}
+	}
 
 	/* parse config file */
-	rootcfg = read_config(rpcd, config_file, config_inline);
+	if (!rootcfg) {
+		rootcfg = read_config(rpcd, config_file, config_inline);
+
+		if (rootcfg && stamp)
+			snapshot_write(rpcd, snapshot, stamp, rootcfg);
+	}
 
 	if (rootcfg)
 		rpcd->cfg = uth_get(rootcfg, "*");
 	else
 		goto err;
 
+	/* read directories in parallel */
+	t1 = now();
+	listings = scan_dirs(rpcd, rootcfg);
+
 	/* read services */
+	t2 = now();
 	rpcd->svcs = thash_create_strkey(NULL, rpcd);
 
 	t = ut_thash(rootcfg);
@@ -288,7 +689,7 @@ struct rpcd *rpcd_init(const char *config_file, bool config_inline)
 		if (streq(svcname, "*"))
 			continue;
 
-		svc = load_svc(rpcd, svcname, svccfg);
+		svc = load_svc(rpcd, svcname, svccfg, listings);
 
 		if (svc) {
 			thash_set(rpcd->svcs, svcname, svc);
@@ -298,69 +699,60 @@ struct rpcd *rpcd_init(const char *config_file, bool config_inline)
 		} else goto err;
 	}
 
-	/* run init() in each module */
+	scan_free(listings);
+	listings = NULL;
+	t3 = now();
+
+	/*
+	 * Run init() in each module - one by one: init() allocates from mod->mm, but may still touch
+	 * the mmatic tree of rpcd, which has no locking, and C modules were never required to be thread-safe in init().
+	 * Modules with slow init() are better made "lazy", see load_lazy().
+	 */
 	THASH_ITER_LOOP(rpcd->svcs, svcname, svc) {
 		THASH_ITER_LOOP(svc->dirs, dirname, dir) {
-			if (dir->common) {
-				if (!dir->common->api->init(dir->common)) {
-					dbg(0, "%s: module initialization failed\n", dir->common->path);
-					goto err;
-				}
-			}
+			if (dir->common && !init_mod(dir->common))
+				goto err;
 
 			THASH_ITER_LOOP(dir->modules, modname, mod) {
-				if (!mod->api->init(mod)) {
-					dbg(0, "%s: module initialization failed\n", mod->path);
+				if (mod->api && !init_mod(mod)) /* !api: lazy */
 					goto err;
-				}
 			}
 		}
 	}
 
+	t4 = now();
+	dbg(1, "startup: config %.3fs, scan %.3fs, load %.3fs, init %.3fs, total %.3fs\n",
+		t1 - t0, t2 - t1, t3 - t2, t4 - t3, t4 - t0);
+
 	return rpcd;
 err:
+	if (listings)
+		scan_free(listings);
+
+	free_mms(rpcd);
 	mmatic_free(rpcd);
 	return NULL;
 }
 
 void rpcd_deinit(struct rpcd *rpcd)
 {
+	shm_deinit(rpcd);
+	free_mms(rpcd);
 	mmatic_free(rpcd);
 }
 
-ut *rpcd_request(struct rpcd *rpcd, const char *method, ut *params)
-{
-	struct req *req;
-
-	req = mmatic_zalloc(sizeof *req, mmatic_create());
-	req->prv = ut_new_thash(NULL, req);
-	req->reply = ut_new_thash(NULL, req);
-	req->params = params;
-	req->method = method;
-
-	return rpcd_handle(rpcd, req);
-}
-
-ut *rpcd_subrequest(struct req *req, const char *method, ut *params)
-{
-	return rpcd_request(req->mod->dir->svc->rpcd, method, params);
-}
-
-ut *rpcd_handle(struct rpcd *rpcd, struct req *req)
+/** Parse method name and find module implementing it
+ * @param query     writable copy of method name in form [[svc.]dir.]method
+ * @param service   service name; if points at NULL, updated with name parsed from query
+ * @param method    updated with bare method name
+ * @retval NULL     not found */
+static struct mod *find(struct rpcd *rpcd, char *query, const char **service, const char **method)
 {
-	char *query, *dotl, *dotr;
+	char *dotl, *dotr;
 	char *svcname = NULL, *dirname = NULL, *metname;
-	struct mod *mod, *common;
-	struct svc *svc = NULL;
-	struct dir *dir = NULL;
-
-	/*
-	 * Parse method = svc.dir.method
-	 */
-	if (!req->method || !req->method[0])
-		goto notfound;
+	struct svc *svc;
+	struct dir *dir;
 
-	query = mmatic_strdup(req->method, req);
 	dotl = strchr(query, '.');
 	dotr = strrchr(query, '.');
 
@@ -381,50 +773,672 @@ ut *rpcd_handle(struct rpcd *rpcd, struct req *req)
 		metname = query;
 	}
 
-	/* update info in req */
-	if (!req->service)
-		req->service = svcname;
+	if (!*service)
+		*service = svcname;
 
-	req->method = metname;
+	*method = metname;
 
-	/*
-	 * Find resources
-	 */
-	svc = req->service ? thash_get(rpcd->svcs, req->service) : rpcd->defsvc;
-	if (!svc) goto notfound;
+	svc = *service ? thash_get(rpcd->svcs, *service) : rpcd->defsvc;
+	if (!svc) return NULL;
 
 	dir = dirname ? thash_get(svc->dirs, dirname) : svc->defdir;
-	if (!dir) goto notfound;
+	if (!dir) return NULL;
 
-	req->mod = thash_get(dir->modules, req->method);
-	if (!req->mod) goto notfound;
+	return thash_get(dir->modules, metname);
+}
 
-	/*
-	 * Handle
-	 */
-	mod = req->mod;
-	common = dir->common;
+/** What to do if C module handler does not finish in time, prepared before it starts */
+static struct {
+	struct mod *mod;                   /** module being watched */
+	char *reply;                       /** timeout error, as O.write() would send it - malloc()ed */
+	size_t len;                        /** length of reply, 0 if nothing to send */
+
+	/* what reply was made for - it is reused while these stay the same, see watchdog_prepare() */
+	char *id;                          /** req->id, malloc()ed */
+	enum rpc_format format;            /** req->format */
+	bool notify;                       /** req->notify */
+	time_t made;                       /** when, as HTTP replies carry a date */
+} W;
+
+/** SIGALRM handler: reply and exit
+ * The handler may have been stopped anywhere, eg. inside malloc() - so only async-signal-safe
+ * calls from here on, and no going back into the process state. */
+static void watchdog(int sig)
+{
+	static const char msg[] = "rpcd: C module handler timed out\n";
+	const char *p = W.reply;
+	size_t left = W.len;
+	ssize_t r;
+
+	while (left > 0) {
+		r = write(1, p, left);
+		if (r == -1) {
+			if (errno == EINTR) continue;
+			break;
+		}
 
-	if (common && common->fw && !generic_fw(req, common->fw))
-		goto reply;
+		p += r;
+		left -= r;
+	}
 
-	if (mod->fw && !generic_fw(req, mod->fw))
+	write(2, msg, sizeof msg - 1);
+	rpcd_timeout(W.mod);
+	_exit(1);
+}
+
+/** Prepare timeout reply to req in W
+ * The reply depends on module, id and format only, so it is serialized again just if one of these
+ * changed since last call, or it got older than WATCHDOG_REUSE - not on each watched call. */
+static void watchdog_prepare(struct req *req)
+{
+	bool notify = req->notify && O.mode != RPCD_HTTP; /* nothing written back, see main() */
+	time_t now = time(NULL);
+	const char *txt;
+	size_t len;
+	ut *reply;
+	bool last;
+
+	if (W.mod == req->mod && W.format == req->format && W.notify == notify &&
+		(W.id && req->id ? streq(W.id, req->id) : W.id == req->id) &&
+		now - W.made < WATCHDOG_REUSE)
+		return;
+
+	free(W.reply);
+	free(W.id);
+	W.reply = NULL;
+	W.len = 0;
+
+	W.mod = req->mod;
+	W.id = req->id ? strdup(req->id) : NULL;
+	W.format = req->format;
+	W.notify = notify;
+	W.made = now;
+
+	if (notify)
+		return;
+
+	reply = req->reply;
+	last = req->last;
+
+	req->last = true;
+	err(JSON_RPC_TIMEOUT, NULL, req->mod->path);
+	txt = O.capture(req, &len);
+
+	req->reply = reply;
+	req->last = last;
+
+	/* outlives req */
+	W.reply = malloc(len);
+	if (W.reply) {
+		memcpy(W.reply, txt, len);
+		W.len = len;
+	}
+}
+
+/** Start or stop the watchdog timer
+ * @param seconds   timeout, 0 stops the timer
+ * @param old       previous SIGALRM action, to restore */
+static void watchdog_set(int seconds, struct sigaction *old)
+{
+	struct itimerval it = { { 0, 0 }, { seconds, 0 } };
+	struct sigaction sa;
+
+	if (seconds > 0) {
+		memset(&sa, 0, sizeof sa);
+		sa.sa_handler = watchdog;
+		sigaction(SIGALRM, &sa, old);
+		setitimer(ITIMER_REAL, &it, NULL);
+	} else {
+		setitimer(ITIMER_REAL, &it, NULL);
+		sigaction(SIGALRM, old, NULL);
+	}
+}
+
+/** Check one rate limit of req->mod
+ * @param rl      limit config: { by = "user"|"addr"|"method", rate = <per second>, burst = <n>, name = <str> }
+ * @retval false  over limit */
+static bool ratelimit_one(struct req *req, ut *rl)
+{
+	struct mod *mod = req->mod;
+	const char *by, *name;
+	char key[256];
+	double rate;
+	int burst;
+	ut *v;
+
+	if (!ut_is_thash(rl))
+		return true;
+
+	by = uth_char(rl, "by");
+	name = uth_char(rl, "name");
+
+	if (!by || streq(by, "user"))
+		snprintf(key, sizeof key, "%s/%s/u/%s", name ? name : "", mod->dir->svc->name,
+			req->user ? req->user : "");
+	else if (streq(by, "addr"))
+		snprintf(key, sizeof key, "%s/%s/a/%s", name ? name : "", mod->dir->svc->name,
+			req->addr ? req->addr : "");
+	else
+		snprintf(key, sizeof key, "%s/%s/m/%s.%s", name ? name : "", mod->dir->svc->name,
+			mod->dir->name, mod->name);
+
+	rate = (v = uth_get(rl, "rate")) ? ut_double(v) : 0;
+	burst = (v = uth_get(rl, "burst")) ? ut_int(v) : MAX(rate, 1);
+
+	return rpcd_ratelimit(mod->dir->svc->rpcd, key, rate, burst);
+}
+
+/** Check rate limits configured for req->mod in "ratelimit" option - a hash or list of hashes
+ * @retval false  over limit, error set in req->reply */
+static bool ratelimit(struct req *req)
+{
+	ut *cfg, *rl;
+
+	cfg = uth_get(req->mod->cfg, "ratelimit");
+	if (!cfg)
+		return true;
+
+	if (ut_is_tlist(cfg)) {
+		TLIST_ITER_LOOP(ut_tlist(cfg), rl) {
+			if (!ratelimit_one(req, rl))
+				return errcode(JSON_RPC_RATE_LIMITED);
+		}
+	} else if (!ratelimit_one(req, cfg)) {
+		return errcode(JSON_RPC_RATE_LIMITED);
+	}
+
+	return true;
+}
+
+/** Check if module handles lazy params */
+static bool lazy_capable(struct mod *mod)
+{
+	return !mod || uth_bool(mod->cfg, "lazy_params");
+}
+
+/** Run firewalls and handlers of req->mod
+ * @param common    common module to run first, may be NULL */
+static ut *call(struct req *req, struct mod *common)
+{
+	struct mod *mod = req->mod;
+	struct rpcd *rpcd = mod->dir->svc->rpcd;
+	struct sigaction old;
+	int timeout = 0;
+
+	/* rejected calls should be cheap - before loading a "lazy" module */
+	if (!req->parent && !ratelimit(req))
 		goto reply;
 
-	if ((common && !common->api->handle(req)) || !(mod->api->handle(req))) {
-		if (ut_ok(req->reply)) errcode(JSON_RPC_ERROR);
+	if (!load_lazy(mod)) {
+		errcode(JSON_RPC_INTERNAL_ERROR);
 		goto reply;
 	}
 
+	/* subrequests run within slots taken by parent - waiting again could deadlock */
+	if (!req->parent) {
+		if (!prio_enter(req))
+			goto reply;
+
+		if (!limit_enter(req, mod->dir->limit)) {
+			prio_leave(req);
+			goto reply;
+		}
+
+		if (!limit_enter(req, mod->limit)) {
+			limit_leave(mod->dir->limit);
+			prio_leave(req);
+			goto reply;
+		}
+
+		timing_mark(req, TIMING_QUEUE);
+	}
+
+	/* parse params now, unless all handlers can do it on demand */
+	if (req->lazy && !(lazy_capable(mod) && lazy_capable(common) && fastjson_lazy_index(req->lazy))) {
+		if (!rpcd_params(req))
+			goto leave;
+	}
+
+	if (common && common->fw && !generic_fw(req, common->fw))
+		goto leave;
+
+	if (mod->fw && !generic_fw(req, mod->fw))
+		goto leave;
+
+	timing_mark(req, TIMING_FW);
+
+	/* C handlers can not be interrupted cleanly - the watchdog replies and ends the process, so
+	 * watch them for top-level requests of rpcd only, not in programs using librpcd */
+	if (mod->type == C && !req->parent && O.capture)
+		timeout = uth_int(mod->cfg, "timeout");
+
+	if (timeout > 0) {
+		watchdog_prepare(req);
+
+		/* for rpcd_timeout() */
+		if (rpcd->cfg && uth_get(rpcd->cfg, "shm"))
+			shm_init(rpcd);
+
+		watchdog_set(timeout, &old);
+	}
+
+	if (common) {
+		if (!common->api->handle(req))
+			goto failed;
+
+		timing_mark(req, TIMING_COMMON);
+	}
+
+	if (!mod->api->handle(req))
+		goto failed;
+
+	timing_mark(req, TIMING_HANDLE);
+
+	if (timeout > 0)
+		watchdog_set(0, &old);
+
+leave:
+	if (!req->parent) {
+		limit_leave(mod->limit);
+		limit_leave(mod->dir->limit);
+		prio_leave(req);
+	}
+
 reply:
 	if (!req->reply) errcode(JSON_RPC_NO_OUTPUT);
 	return req->reply;
 
+failed:
+	if (timeout > 0) watchdog_set(0, &old);
+	if (ut_ok(req->reply)) errcode(JSON_RPC_ERROR);
+	goto leave;
+}
+
+ut *rpcd_request(struct rpcd *rpcd, const char *method, ut *params)
+{
+	struct req *req;
+
+	req = mmatic_zalloc(sizeof *req, mmatic_create());
+	req->prv = ut_new_thash(NULL, req);
+	req->reply = ut_new_thash(NULL, req);
+	req->params = params;
+	req->method = method;
+
+	return rpcd_handle(rpcd, req);
+}
+
+struct mod *rpcd_find(struct rpcd *rpcd, const char *service, const char *method)
+{
+	const char *metname;
+
+	if (!method || !method[0])
+		return NULL;
+
+	char query[strlen(method) + 1];
+	strcpy(query, method);
+
+	return find(rpcd, query, &service, &metname);
+}
+
+ut *rpcd_subrequest(struct req *req, const char *method, ut *params)
+{
+	struct svc *svc = req->mod->dir->svc;
+	struct mod *mod;
+
+	if (!method || !method[0])
+		return ut_new_err(JSON_RPC_NOT_FOUND, "Method not found", NULL, req);
+
+	/* in the service of req, unless method names another one */
+	mod = rpcd_find(svc->rpcd, strchr(method, '.') != strrchr(method, '.') ? NULL : svc->name, method);
+	if (!mod)
+		return ut_new_err(JSON_RPC_NOT_FOUND, "Method not found", method, req);
+
+	return rpcd_subrequest_mod(req, mod, params);
+}
+
+ut *rpcd_subrequest_mod(struct req *req, struct mod *mod, ut *params)
+{
+	struct req *sub;
+
+	/* live in parent memory, inherit its auth and transport context */
+	sub = mmatic_alloc(sizeof *sub, req);
+	*sub = *req;
+
+	sub->parent = req;
+	sub->lazy = NULL;
+	sub->timing = NULL;
+	sub->mod = mod;
+	sub->service = mod->dir->svc->name;
+	sub->method = mod->name;
+	sub->params = params ? params : ut_new_thash(NULL, req);
+	sub->reply = ut_new_thash(NULL, req);
+
+	/* common module of the same directory already accepted the parent request */
+	return call(sub, (mod->dir == req->mod->dir) ? NULL : mod->dir->common);
+}
+
+/** Child of rpcd_subrequest_many() in progress */
+struct subchild {
+	pid_t pid;                         /** child process, 0 if not running */
+	int fd;                            /** read end of reply pipe */
+	xstr *out;                         /** reply read so far */
+};
+
+/** Make subrequest in a child process, which writes reply to a pipe and exits
+ * @retval false  could not fork, call->reply set to error */
+static bool subfork(struct req *req, struct subcall *call, struct subchild *ch)
+{
+	int pfd[2];
+	ut *env, *rep;
+	xstr *xs;
+	const char *p;
+	ssize_t r, left;
+
+	if (pipe2(pfd, O_CLOEXEC) == -1) {
+		call->reply = ut_new_err(JSON_RPC_INTERNAL_ERROR, "pipe() failed", call->method, req);
+		return false;
+	}
+
+	ch->pid = fork();
+	if (ch->pid == -1) {
+		ch->pid = 0;
+		close(pfd[0]);
+		close(pfd[1]);
+		call->reply = ut_new_err(JSON_RPC_INTERNAL_ERROR, "fork() failed", call->method, req);
+		return false;
+	}
+
+	if (ch->pid == 0) {
+		close(pfd[0]);
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+		/* [0, reply] or [code, message] - MessagePack keeps the types, unlike plain JSON errors */
+		rep = rpcd_subrequest(req, call->method, call->params);
+		env = ut_new_tlist(NULL, req);
+
+		if (ut_ok(rep)) {
+			tlist_push(ut_tlist(env), ut_new_int(0, req));
+			tlist_push(ut_tlist(env), rep);
+		} else {
+			tlist_push(ut_tlist(env), ut_new_int(ut_errcode(rep), req));
+			tlist_push(ut_tlist(env), ut_new_char(ut_err(rep), req));
+		}
+
+		xs = binary_print(FMT_MSGPACK, env, req);
+		p = xstr_string(xs);
+
+		for (left = xstr_length(xs); left > 0; p += r, left -= r) {
+			r = write(pfd[1], p, left);
+			if (r == -1 && errno == EINTR) r = 0;
+			else if (r <= 0) break;
+		}
+
+		/* do not run atexit() handlers of the parent, eg. access log flush */
+		_exit(0);
+	}
+
+	close(pfd[1]);
+	ch->fd = pfd[0];
+	ch->out = xstr_create("", req);
+	return true;
+}
+
+/** Collect reply of finished child */
+static void subreap(struct req *req, struct subcall *call, struct subchild *ch)
+{
+	ut *env, *code, *rep;
+
+	close(ch->fd);
+	waitpid(ch->pid, NULL, 0);
+	ch->pid = 0;
+
+	env = binary_parse(FMT_MSGPACK, xstr_string(ch->out), xstr_length(ch->out), req);
+	if (!ut_is_tlist(env) || tlist_count(ut_tlist(env)) != 2) {
+		call->reply = ut_new_err(JSON_RPC_INTERNAL_ERROR, "Subrequest died", call->method, req);
+		return;
+	}
+
+	code = tlist_shift(ut_tlist(env));
+	rep = tlist_shift(ut_tlist(env));
+
+	if (ut_int(code) == 0)
+		call->reply = rep;
+	else
+		call->reply = ut_new_err(ut_int(code), ut_char(rep), call->method, req);
+}
+
+void rpcd_subrequest_many(struct req *req, struct subcall *calls, int count, int timeout)
+{
+	struct subchild *ch;
+	struct pollfd *fds;
+	double deadline = 0;
+	int i, n, r, left, next = 0, running = 0;
+	const char *msg = NULL;
+	char buf[BUFSIZ];
+
+	if (count <= 0)
+		return;
+
+	ch = mmatic_zalloc(count * sizeof *ch, req);
+	fds = mmatic_alloc(count * sizeof *fds, req);
+
+	if (timeout > 0)
+		deadline = now() + timeout / 1000.0;
+
+	for (;;) {
+		/* keep up to RPCD_SUBREQUEST_PARALLEL children running */
+		for (; next < count && running < RPCD_SUBREQUEST_PARALLEL; next++) {
+			calls[next].reply = NULL;
+
+			if (subfork(req, &calls[next], &ch[next]))
+				running++;
+		}
+
+		if (running == 0)
+			break;
+
+		for (i = 0, n = 0; i < next; i++) {
+			if (!ch[i].pid) continue;
+			fds[n].fd = ch[i].fd;
+			fds[n].events = POLLIN;
+			fds[n].revents = 0;
+			n++;
+		}
+
+		left = deadline ? (deadline - now()) * 1000 : -1;
+		if (deadline && left <= 0)
+			break;
+
+		r = poll(fds, n, left);
+		if (r == -1 && errno != EINTR) {
+			msg = "poll() failed";
+			break;
+		}
+
+		for (i = 0, n = 0; i < next; i++) {
+			if (!ch[i].pid) continue;
+
+			if (fds[n++].revents == 0)
+				continue;
+
+			r = read(ch[i].fd, buf, sizeof buf);
+			if (r > 0) {
+				xstr_append_size(ch[i].out, buf, r);
+			} else if (r == 0 || errno != EINTR) {
+				subreap(req, &calls[i], &ch[i]);
+				running--;
+			}
+		}
+	}
+
+	/* out of time or poll() failed: kill what is left, give up on calls not started */
+	for (i = 0; i < count; i++) {
+		if (ch[i].pid) {
+			kill(ch[i].pid, SIGKILL);
+			close(ch[i].fd);
+			waitpid(ch[i].pid, NULL, 0);
+			ch[i].pid = 0;
+		}
+
+		if (!calls[i].reply && msg)
+			calls[i].reply = ut_new_err(JSON_RPC_INTERNAL_ERROR, msg, calls[i].method, req);
+		else if (!calls[i].reply)
+			calls[i].reply = ut_new_err(JSON_RPC_TIMEOUT, "Timeout", calls[i].method, req);
+	}
+}
+
+ut *rpcd_handle(struct rpcd *rpcd, struct req *req)
+{
+	/*
+	 * Parse method = svc.dir.method and find resources
+	 */
+	if (!req->method || !req->method[0])
+		goto notfound;
+
+	req->mod = find(rpcd, mmatic_strdup(req->method, req), &req->service, &req->method);
+	if (!req->mod) goto notfound;
+
+	/*
+	 * Handle
+	 */
+	return call(req, req->mod->dir->common);
+
 notfound:
 	errcode(JSON_RPC_NOT_FOUND);
 	return req->reply;
 }
 
+thash *rpcd_http_headers(struct req *req)
+{
+	const char *p, *name;
+	int i;
+
+	if (req->http.headers || !req->http.head)
+		return req->http.headers;
+
+	req->http.headers = thash_create_strkey(NULL, req);
+
+	p = req->http.head;
+	for (i = 0; i < req->http.count; i++) {
+		name = p;
+		p += strlen(p) + 1;
+
+		thash_set(req->http.headers, name, (void *) p);
+		p += strlen(p) + 1;
+	}
+
+	return req->http.headers;
+}
+
+ut *rpcd_param(struct req *req, const char *name)
+{
+	struct lazy *lz;
+	ut *val;
+
+	if ((val = uth_get(req->params, name)) || !req->lazy)
+		return val;
+
+	if (!(lz = fastjson_lazy_member(req->lazy, name)))
+		return NULL;
+
+	val = fastjson_lazy_parse(lz, req);
+	if (ut_ok(val))
+		uth_set(req->params, name, val);
+
+	return val;
+}
+
+bool rpcd_params(struct req *req)
+{
+	ut *params, *v;
+	const char *k;
+
+	if (!req->lazy)
+		return true;
+
+	params = fastjson_lazy_parse(req->lazy, req);
+	req->lazy = NULL;
+
+	if (!ut_ok(params)) {
+		req->reply = params;
+		return false;
+	}
+
+	/* keep parameters already parsed (and possibly converted by firewall) */
+	if (ut_is_thash(params)) {
+		THASH_ITER_LOOP(ut_thash(req->params), k, v)
+			uth_set(params, k, v);
+	}
+
+	req->params = params;
+	return true;
+}
+
+void rpcd_unload_idle(struct rpcd *rpcd)
+{
+	const char *svcname, *dirname, *modname;
+	struct svc *svc;
+	struct dir *dir;
+	struct mod *mod;
+	time_t now = time(NULL);
+	int idle;
+
+	/* at most once a second */
+	if (rpcd->idlecheck == now)
+		return;
+	rpcd->idlecheck = now;
+
+	THASH_ITER_LOOP(rpcd->svcs, svcname, svc) {
+		THASH_ITER_LOOP(svc->dirs, dirname, dir) {
+			THASH_ITER_LOOP(dir->modules, modname, mod) {
+				if (mod->type != C || !mod->so || !uth_bool(mod->cfg, "lazy"))
+					continue;
+
+				idle = uth_int(mod->cfg, "idle_unload");
+				if (idle <= 0 || now - mod->used < idle)
+					continue;
+
+				pthread_mutex_lock(&load_lock);
+				dbg(3, "%s: idle for %ds, unloading\n", mod->path, (int) (now - mod->used));
+
+				mod->api->deinit(mod);
+				dlclose(mod->so);
+				mod->so = NULL;
+				mod->api = NULL;
+				mod->fw = NULL;
+
+				/* drop what init() allocated, see load_lazy() for the next load */
+				unload_mm(mod);
+
+				pthread_mutex_unlock(&load_lock);
+			}
+		}
+	}
+}
+
+void rpcd_timeout(struct mod *mod)
+{
+	struct rpcd *rpcd = mod->dir->svc->rpcd;
+	const char *parts[] = { "timeouts:", mod->dir->svc->name, ".", mod->dir->name, ".", mod->name };
+	char key[256];
+	size_t i, n, len = 0;
+
+	mod->timeouts++;
+
+	if (!rpcd->cfg || !uth_get(rpcd->cfg, "shm") || !shm_init(rpcd))
+		return;
+
+	/* no snprintf() nor malloc() - see watchdog() */
+	for (i = 0; i < sizeof parts / sizeof parts[0]; i++) {
+		n = MIN(strlen(parts[i]), sizeof key - 1 - len);
+		memcpy(key + len, parts[i], n);
+		len += n;
+	}
+	key[len] = '\0';
+
+	shm_incr(rpcd, key);
+}
+
 void rpcd_reqfree(ut *reply)
 {
 	mmatic_free(reply);
@@ -455,6 +1469,10 @@ bool rpcd_error(struct req *req, int code, const char *msg, const char *data,
 		case JSON_RPC_HTTP_OPTIONS:    msg = "OK"; break;
 		case JSON_RPC_HTTP_NOT_FOUND:  msg = "Document not found"; break;
 		case JSON_RPC_ERROR:           msg = "Error"; break;
+		case JSON_RPC_OVERLOADED:      msg = "Server busy"; break;
+		case JSON_RPC_TIMEOUT:         msg = "Timeout"; break;
+		case JSON_RPC_RATE_LIMITED:    msg = "Rate limit exceeded"; break;
+		case JSON_RPC_HTTP_UPGRADE:    msg = "Switching Protocols"; break;
 	}
 
 	if (!data)
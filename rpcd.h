@@ -16,6 +16,9 @@
 #define RPCD_VER "0.2"
 #define RPCD_DEFAULT_CONFIGFILE "rpcd.conf"
 #define RPCD_DEFAULT_PIDFILE "/var/run/rpcd.pid"
+#define RPCD_DEFAULT_KEEPALIVE_IDLE 15
+#define RPCD_DEFAULT_KEEPALIVE_MAX 100
+#define RPCD_SUBREQUEST_PARALLEL 32
 
 /***************************************************************************************************/
 
@@ -26,6 +29,10 @@ struct mod;                            /** JSON-RPC "method" */
 struct req;                            /** Representation of request, including the reply */
 struct api;                            /** Links to functions implementing given module */
 struct fw;                             /** Represents one rule in module "parameter firewall" */
+struct shm;                            /** Shared memory segment, see shm.c */
+struct lazy;                           /** JSON text parsed on demand, see fastjson.c */
+struct limit;                          /** Concurrency limit, see limit.c */
+struct prio;                           /** Scheduler of priority classes, see prio.c */
 
 /***************************************************************************************************/
 
@@ -39,11 +46,24 @@ struct fw;                             /** Represents one rule in module "parame
  * @return              rpcd handle, which is ready */
 struct rpcd *rpcd_init(const char *config_file, bool config_inline);
 
+/** Initialize rpcd, reusing a snapshot of parsed configuration
+ * Same as rpcd_init(), but if snapshot is not NULL and config file did not change since the
+ * snapshot was written (by mtime and size), the config file is not parsed at all. Otherwise,
+ * the snapshot is (re-)written.
+ * @param snapshot      path to snapshot file, may be NULL */
+struct rpcd *rpcd_init_snapshot(const char *config_file, bool config_inline, const char *snapshot);
+
 /** Deinitialize rpcd, freeing memory
  * @param rpcd         rpcd handle
  * @note make sure not to use any memory taken from rpcd after calling rpcd_deinit() */
 void rpcd_deinit(struct rpcd *rpcd);
 
+/** Unload C modules idle for too long
+ * Applies to modules with "lazy = true" and "idle_unload = <seconds>" set in config - they are
+ * deinitialized and dlclose()d, to be loaded again on next call. Cheap to call after each request.
+ * @param rpcd         rpcd handle */
+void rpcd_unload_idle(struct rpcd *rpcd);
+
 /** Make a request
  * @param rpcd         rpcd handle
  * @param method       name of the method to call
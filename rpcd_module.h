@@ -19,6 +19,9 @@ struct rpcd {
 	ut *cfg;                           /** configuration: * */
 	thash *svcs;                       /** char (service name) => struct svc: available services */
 	struct svc *defsvc;                /** default service */
+	struct shm *shm;                   /** shared memory segment, mapped on first use */
+	time_t idlecheck;                  /** last run of rpcd_unload_idle() */
+	struct prio *prio;                 /** scheduler config, read on first use - see prio_get() */
 };
 
 struct svc {
@@ -40,50 +43,79 @@ struct dir {
 	const char *path;                  /** full directory path */
 	thash *modules;                    /** char (module name) => struct mod: modules implementing procedures */
 	struct mod *common;                /** the common module */
+	struct limit *limit;               /** concurrency limit for all modules, may be NULL */
 };
 
 struct mod {
 	struct dir *dir;                   /** way up */
 	const char *name;                  /** procedure name */
 	ut *cfg;                           /** configuration: svc.dir.mod */
-	ut *prv;                           /** module internal data hash */
+	ut *prv;                           /** module internal data hash, allocated in mm */
+	void *mm;                          /** mmatic context for init() allocations, freed on unload */
 
 	const char *path;                  /** full path to module file (XXX: != dir->name/name - includes extension) */
 	enum modtype { C, JS, SH } type;   /** implemented in? */
-	struct api *api;                   /** implementation API */
+	struct api *api;                   /** implementation API, NULL if not loaded yet (see "lazy") */
 	struct fw *fw;                     /** array of firewall rules, ended by NULL */
+	void *so;                          /** for C modules: dlopen() handle, NULL if not loaded yet */
+	time_t used;                       /** time of last call */
+	struct limit *limit;               /** concurrency limit, may be NULL */
+	unsigned int timeouts;             /** number of calls that timed out in this process */
 };
 
 struct req {
 	struct mod *mod;                   /** way up */
-	ut *prv;                           /** request internal data hash */
+	struct req *parent;                /** if not NULL, this is a subrequest made by parent */
+	ut *prv;                           /** request internal data hash (shared with subrequests) */
 
 	const char *service;               /** called service */
 	const char *method;                /** called method */
 	const char *id;                    /** optional ID, if present */
 	ut *params;                        /** the "params" argument */
+	struct lazy *lazy;                 /** if not NULL, params not fully parsed yet - see rpcd_param() */
 	ut *reply;                         /** reply, may be NULL */
+	enum rpc_format format;            /** format to write the reply in */
 
 	const char *user;                  /** if not null, points at authenticated user */
 	const char *pass;                  /** if not null, holds password of authed user */
+	const char *addr;                  /** if not null, client network address */
+	unsigned int insize;               /** size of request as read, 0 if unknown */
+	unsigned int outsize;              /** size of reply as written */
 	bool last;                         /** if true, exit after handling this request */
+	bool notify;                       /** if true, JSON-RPC 2.0 notification - no reply wanted */
+	struct timing *timing;             /** if not NULL, phase timestamps - see timing.h */
 
 	/* HTTP handling */
 	struct req_http {
-		thash *headers;                /** if not NULL, holds HTTP headers */
+		thash *headers;                /** all HTTP headers, NULL until rpcd_http_headers() is called */
+		const char *content_type;      /** Content-Type header, NULL if not given */
+		const char *content_length;    /** Content-Length header */
+		const char *accept;            /** Accept header */
+		const char *authorization;     /** Authorization header */
+		const char *connection;        /** Connection header */
+		const char *if_modified_since; /** If-Modified-Since header */
+		const char *if_none_match;     /** If-None-Match header */
+		const char *qooxdoo;           /** X-Qooxdoo-Response-Type header */
+		const char *upgrade;           /** Upgrade header */
+		const char *ws_key;            /** Sec-WebSocket-Key header */
+		const char *ws_version;        /** Sec-WebSocket-Version header */
+		const char *head;              /** raw headers: count pairs of \0-terminated name and value */
+		int count;                     /** number of headers in head */
 		const char *uripath;           /** full filesystem path to requested doc */
 		const char *user;              /** requester claims to be this user */
 		const char *pass;              /** and gives us this password to verify him */
-		bool needauth;                 /** if true, require authentication if available */
+		bool needauth;                 /** if true, require authentication if available - cleared once checked */
+		bool get;                      /** if true, RPC call made with GET /rpc/<method>, see "cache" */
 	} http;
 };
 
 struct api {
 	uint32_t tag;                      /** for sanity checks */
-#define RPCD_TAG 0x13370003
+#define RPCD_TAG 0x13370004
 
 	/** Module initialization
-	 * @param   mod   module instance, feel free to use mod->prv */
+	 * @param   mod   module instance, feel free to use mod->prv
+	 * @note allocate from mod->mm - it is freed when a "lazy" module is unloaded */
 	bool (*init)(struct mod *mod);
 
 	/** Module deinitialization
@@ -114,10 +146,119 @@ struct fw {
  * @param req          properly initialized struct req object */
 ut *rpcd_handle(struct rpcd *rpcd, struct req *req);
 
+/** Find module implementing given method
+ * @param rpcd      rpcd handle
+ * @param service   service name; if NULL, take it from method or use the default service
+ * @param method    method name in form [[svc.]dir.]method
+ * @retval NULL     method not found
+ * @note the result stays valid until rpcd_deinit(), so callers may cache it */
+struct mod *rpcd_find(struct rpcd *rpcd, const char *service, const char *method);
+
 /** Make a subrequest
- * @param req       current request */
+ * @param req       current request
+ * @param method    method name, see rpcd_find() - in the service of req, unless given in method
+ * @param params    parameters, may be NULL
+ * @return reply, allocated in memory of req - do not call rpcd_reqfree() on it */
 ut *rpcd_subrequest(struct req *req, const char *method, ut *params);
 
+/** Make a subrequest to a module already found by rpcd_find()
+ * The subrequest inherits authentication and HTTP context of req. If mod lives in the same
+ * directory as req->mod, the common module is not run again, as it already accepted req.
+ * @param req       current request
+ * @param mod       target module
+ * @param params    parameters, may be NULL
+ * @return reply, allocated in memory of req */
+ut *rpcd_subrequest_mod(struct req *req, struct mod *mod, ut *params);
+
+/** One call of rpcd_subrequest_many() */
+struct subcall {
+	const char *method;                /** method name, see rpcd_find() */
+	ut *params;                        /** parameters, may be NULL */
+	ut *reply;                         /** set to reply, allocated in memory of req */
+};
+
+/** Make many independent subrequests at once
+ * Each call runs in a forked child process, at most RPCD_SUBREQUEST_PARALLEL at a time, so the
+ * whole takes about as long as the slowest call. Changes the calls make to process memory - eg.
+ * to req->prv or module state - are lost; use rpcd_shm_set() if needed.
+ * @param req       current request
+ * @param calls     calls to make, replies are stored in calls[i].reply
+ * @param count     number of calls
+ * @param timeout   overall deadline in ms, 0 means none; calls not finished by then are killed
+ *                  and get JSON_RPC_TIMEOUT errors (JSON_RPC_INTERNAL_ERROR if waiting failed) */
+void rpcd_subrequest_many(struct req *req, struct subcall *calls, int count, int timeout);
+
+/** Get all HTTP headers of request
+ * Headers used by rpcd itself are available directly in req->http. Others are put in a hash on
+ * first call, which is cached in req->http.headers.
+ * @retval NULL     not a HTTP request */
+thash *rpcd_http_headers(struct req *req);
+
+/** Get request parameter, parsing it on demand
+ * If module config has "lazy_params = true", only parameters asked for are parsed out of request
+ * body - req->params holds just these. Otherwise it is the same as uth_get(req->params, name).
+ * @param req       current request
+ * @param name      parameter name
+ * @retval NULL     parameter not found
+ * @return          parameter value, or ut_err if it could not be parsed */
+ut *rpcd_param(struct req *req, const char *name);
+
+/** Parse all request parameters into req->params
+ * @retval false    parse error, set in req->reply */
+bool rpcd_params(struct req *req);
+
+/** Count a timeout of given module
+ * Increments mod->timeouts and, if "shm" is configured, the "timeouts:<svc>.<dir>.<mod>" key in
+ * shared memory, which keeps the total for all rpcd processes. Async-signal-safe once the shared
+ * memory is mapped, see shm_init().
+ * @param mod       module that timed out */
+void rpcd_timeout(struct mod *mod);
+
+/** Get value from memory shared between rpcd processes
+ * Segment name is taken from the "shm" option in the "*" section of rpcd config: "/rpcd-<shm>",
+ * or "/rpcd-default" if not set - shared by all rpcd instances on the host that do not set it.
+ * @param rpcd      rpcd handle
+ * @param key       key name, shorter than 64 chars
+ * @param val       set to copy of the value, or to NULL if not found or deleted
+ * @param mm        mmatic context to allocate the value in
+ * @retval 0        key not found
+ * @return          version of the value, use with rpcd_shm_set() */
+uint32_t rpcd_shm_get(struct rpcd *rpcd, const char *key, char **val, void *mm);
+
+/** Set value in memory shared between rpcd processes
+ * @param key       key name, shorter than 64 chars
+ * @param val       value to store, shorter than 960 chars; NULL deletes the value
+ * @param version   if non-zero, update only if current version matches (compare-and-set)
+ * @retval 0        failed, or version did not match
+ * @return          new version of the value */
+uint32_t rpcd_shm_set(struct rpcd *rpcd, const char *key, const char *val, uint32_t version);
+
+/** Acquire a named lock shared between rpcd processes
+ * Locks are robust: a lock held by a process that died is recovered by the next owner.
+ * @param name      lock name, shorter than 64 chars, eg. "/etc/fc"
+ * @param wait      if false, fail instead of waiting for lock held by other process
+ * @retval false    failed or lock busy */
+bool rpcd_lock(struct rpcd *rpcd, const char *name, bool wait);
+
+/** Release a named lock acquired with rpcd_lock() */
+bool rpcd_unlock(struct rpcd *rpcd, const char *name);
+
+/** Take a token from a rate limiting bucket shared between rpcd processes
+ * Buckets live in the shared memory segment of rpcd_shm_get(), created on first use - set "shm"
+ * to keep rpcd instances with different configs from sharing buckets of the same name.
+ * @param name      bucket name
+ * @param rate      tokens added per second
+ * @param burst     bucket capacity
+ * @retval false    bucket empty - over limit */
+bool rpcd_ratelimit(struct rpcd *rpcd, const char *name, double rate, int burst);
+
+/** Get phase timing histograms of sampled requests, common for all rpcd processes
+ * @return hash: samples => number of sampled requests, <phase> => list of TIMING_BUCKETS counts,
+ *         where n-th count is number of requests with phase duration < 2^n us
+ * @param mm        mmatic context to allocate the result in, eg. req
+ * @retval NULL     shared memory not available */
+ut *rpcd_timing_stats(struct rpcd *rpcd, void *mm);
+
 /** Set error in req->reply
  * @param req       request to update req->reply to new ut_err in
  * @param code      error code
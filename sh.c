@@ -3,73 +3,570 @@
  * Licensed under GPLv3
  */
 
+#define _GNU_SOURCE 1
+
 #include <signal.h>
+#include <poll.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
 #include "common.h"
 
-static char escbuf[4096];
+extern char **environ;
+
+/** Maps bytes of parameter names to valid environment variable name characters */
+static char keymap[256];
 
-static const char *escape(const char *what)
+/** Environment common to all calls of a module, see sh_init() */
+struct shenv {
+	int count;                         /** number of entries */
+	char **entries;                    /** "NAME=value" strings */
+	char **names;                      /** just the NAME parts */
+};
+
+/** Milliseconds since some point in the past */
+static long long msnow(void)
 {
-	int i, j;
+	struct timespec ts;
 
-	for (i = 0, j = 0; what[i] && j < sizeof escbuf - 2; i++) {
-		if (what[i] == '\'' || what[i] == '\\' || what[i] == '"')
-			continue;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/** Receiver of child stdout, called for each chunk as it arrives
+ * @retval false  stop reading and kill the child */
+typedef bool (*sink_t)(void *arg, const char *buf, int len);
+
+static bool sink_xstr(void *arg, const char *buf, int len)
+{
+	xstr_append_size(arg, buf, len);
+	return true;
+}
+
+/** Run a program, streaming its stdout into a sink
+ * Uses posix_spawn(), which on Linux does not copy page tables of our - possibly large - process.
+ * The child gets its own process group, so the whole tree can be killed on timeout.
+ * @param argv      arguments, argv[0] is the program path
+ * @param envp      environment
+ * @param in        stdin of the program, -1 means /dev/null
+ * @param sink      called for stdout data
+ * @param arg       sink argument
+ * @param timeout   timeout in ms, 0 means no timeout
+ * @retval -1       failed to run
+ * @retval -2       timed out
+ * @retval -3       rejected by sink
+ * @return          exit code */
+static int run(char **argv, char **envp, int in, sink_t sink, void *arg, xstr *err, int timeout)
+{
+	int po[2], pe[2], status, n, open = 2, rc;
+	struct pollfd fds[2];
+	long long deadline = msnow() + timeout, left = -1;
+	char buf[BUFSIZ];
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	sigset_t sigs;
+	pid_t pid;
+
+	if (pipe2(po, O_CLOEXEC) == -1)
+		return -1;
+	if (pipe2(pe, O_CLOEXEC) == -1) {
+		close(po[0]); close(po[1]);
+		return -1;
+	}
+
+	posix_spawn_file_actions_init(&fa);
+	if (in >= 0)
+		posix_spawn_file_actions_adddup2(&fa, in, 0);
+	else
+		posix_spawn_file_actions_addopen(&fa, 0, "/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_adddup2(&fa, po[1], 1);
+	posix_spawn_file_actions_adddup2(&fa, pe[1], 2);
+
+	/* we ignore SIGPIPE, the child should not */
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr,
+		POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+	posix_spawnattr_setpgroup(&attr, 0);
+	sigemptyset(&sigs);
+	posix_spawnattr_setsigmask(&attr, &sigs);
+	sigaddset(&sigs, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &sigs);
+
+	rc = posix_spawn(&pid, argv[0], &fa, &attr, argv, envp);
+
+	/* no shebang line: let the shell interpret it, like execvp() would */
+	if (rc == ENOEXEC) {
+		for (n = 0; argv[n]; n++);
+		char **shargv = mmatic_alloc((n + 2) * sizeof *shargv, err);
+		shargv[0] = "/bin/sh";
+		memcpy(shargv + 1, argv, (n + 1) * sizeof *shargv);
+
+		rc = posix_spawn(&pid, shargv[0], &fa, &attr, shargv, envp);
+	}
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+	close(po[1]);
+	close(pe[1]);
+
+	if (rc != 0) {
+		close(po[0]); close(pe[0]);
+		errno = rc;
+		return -1;
+	}
+
+	fds[0].fd = po[0];
+	fds[1].fd = pe[0];
+	fds[0].events = fds[1].events = POLLIN;
+
+	while (open > 0) {
+		if (timeout > 0)
+			left = deadline - msnow();
+
+		if ((timeout > 0 && left <= 0) || poll(fds, 2, left) == 0) {
+			killpg(pid, SIGKILL);
+			waitpid(pid, &status, 0);
+			close(po[0]); close(pe[0]);
+			return -2;
+		}
+
+		for (n = 0; n < 2; n++) {
+			if (fds[n].fd < 0 || !fds[n].revents)
+				continue;
+
+			int r = read(fds[n].fd, buf, sizeof buf);
+			if (r > 0) {
+				if (n == 1) {
+					xstr_append_size(err, buf, r);
+				} else if (!sink(arg, buf, r)) {
+					killpg(pid, SIGKILL);
+					waitpid(pid, &status, 0);
+					if (fds[0].fd >= 0) close(fds[0].fd);
+					if (fds[1].fd >= 0) close(fds[1].fd);
+					return -3;
+				}
+			} else if (r == 0 || errno != EINTR) {
+				close(fds[n].fd);
+				fds[n].fd = -1;
+				open--;
+			}
+		}
+	}
+
+	/* the program may go on after closing its outputs - eg. passing them to a daemon */
+	if (timeout > 0) {
+		while ((rc = waitpid(pid, &status, WNOHANG)) == 0 || (rc == -1 && errno == EINTR)) {
+			left = deadline - msnow();
+			if (left <= 0) {
+				killpg(pid, SIGKILL);
+				waitpid(pid, &status, 0);
+				return -2;
+			}
+
+			poll(NULL, 0, MIN(left, 10));
+		}
+	} else {
+		rc = waitpid(pid, &status, 0);
+	}
 
-		escbuf[j++] = what[i];
+	if (rc == -1)
+		return -1;
+
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/** Make "NAME=value" environment entry, mapping invalid name characters to '_' */
+static char *envent(const char *name, const char *val, void *mm)
+{
+	int nl = strlen(name), vl = strlen(val), i;
+	char *e;
+
+	e = mmatic_alloc(nl + vl + 2, mm);
+	for (i = 0; i < nl; i++)
+		e[i] = keymap[(unsigned char) name[i]];
+	e[nl] = '=';
+	memcpy(e + nl + 1, val, vl + 1);
+
+	return e;
+}
+
+/** Structured output of a shell module, see "output" in module config */
+struct output {
+	struct req *req;                   /** request */
+	bool nd;                           /** if true, one JSON value per line */
+	char *buf;                         /** not yet parsed data */
+	int len;                           /** length of data in buf */
+	int size;                          /** allocated size of buf */
+	int total;                         /** total bytes received */
+	int max;                           /** limit on total, 0 means no limit */
+	tlist *items;                      /** if nd: values parsed so far */
+	bool broken;                       /** if true, a line failed to parse */
+};
+
+/** Parse one JSON value from the output buffer
+ * @param txt  text, \0-terminated
+ * @return     parsed object or ut_err */
+static ut *output_parse(struct output *o, char *txt, int len)
+{
+	ut *v;
+
+	v = fastjson_parse(txt, len, o->req);
+	if (!v)
+		v = json_parse(json_create(o->req), txt);
+
+	return v;
+}
+
+/** Take next chunk of child stdout, parsing complete lines in ndjson mode */
+static bool output_sink(void *arg, const char *buf, int len)
+{
+	struct output *o = arg;
+	char *line, *nl, *end;
+	ut *v;
+
+	o->total += len;
+	if (o->max > 0 && o->total > o->max)
+		return false;
+
+	if (o->len + len + 1 > o->size) {
+		o->size = MAX(o->size * 2, o->len + len + 1);
+		o->buf = mmatic_realloc(o->buf, o->size, o->req);
 	}
 
-	escbuf[j] = '\0';
-	return escbuf;
+	memcpy(o->buf + o->len, buf, len);
+	o->len += len;
+	o->buf[o->len] = '\0';
+
+	if (!o->nd || o->broken)
+		return true;
+
+	/* parse complete lines in place, keep the tail for later */
+	line = o->buf;
+	end = o->buf + o->len;
+	while ((nl = memchr(line, '\n', end - line))) {
+		*nl = '\0';
+
+		if (nl > line && !(nl - line == 1 && line[0] == '\r')) {
+			v = output_parse(o, line, nl - line);
+			if (!ut_ok(v)) {
+				o->broken = true;
+				return true;
+			}
+
+			tlist_push(o->items, v);
+		}
+
+		line = nl + 1;
+	}
+
+	if (line > o->buf) {
+		o->len = end - line;
+		memmove(o->buf, line, o->len);
+		o->buf[o->len] = '\0';
+	}
+
+	return true;
+}
+
+/** Finish parsing structured output
+ * @return reply or ut_err */
+static ut *output_finish(struct output *o)
+{
+	ut *v;
+
+	if (!o->nd) {
+		if (o->len == 0)
+			return ut_new_err(JSON_RPC_NO_OUTPUT, "No output", NULL, o->req);
+
+		return output_parse(o, o->buf, o->len);
+	}
+
+	/* last line need not be terminated */
+	if (!o->broken && o->len > 0 && strspn(o->buf, " \t\r") < o->len) {
+		v = output_parse(o, o->buf, o->len);
+		if (!ut_ok(v))
+			o->broken = true;
+		else
+			tlist_push(o->items, v);
+	}
+
+	if (o->broken)
+		return ut_new_err(JSON_RPC_OUT_PARSE_ERROR, "Output parse error", NULL, o->req);
+
+	return ut_new_tlist(o->items, o->req);
 }
 
 static bool sh_init(struct mod *mod)
 {
+	struct shenv *base;
+	thash *cfgenv;
+	char **e, *k, *eq;
+	ut *u, *v;
+	int i, n;
+
 	signal(SIGPIPE, SIG_IGN);
+
+	if (!keymap['_']) {
+		for (i = 0; i < 256; i++)
+			keymap[i] = ((i >= '0' && i <= '9') || (i >= 'A' && i <= 'Z') ||
+				(i >= 'a' && i <= 'z')) ? i : '_';
+	}
+
+	/* snapshot our environment, plus module "env" from config */
+	u = uth_get(mod->cfg, "env");
+	cfgenv = (u && ut_is_thash(u)) ? ut_thash(u) : NULL;
+	n = 0;
+	for (e = environ; *e; e++) n++;
+	if (cfgenv) n += thash_count(cfgenv);
+
+	base = mmatic_zalloc(sizeof *base, mod->mm);
+	base->entries = mmatic_alloc((n + 1) * sizeof(char *), mod->mm);
+	base->names = mmatic_alloc((n + 1) * sizeof(char *), mod->mm);
+
+	if (cfgenv) {
+		THASH_ITER_LOOP(cfgenv, k, v) {
+			base->entries[base->count] = envent(k, ut_char(v), mod->mm);
+			base->names[base->count] = mmatic_strdup(base->entries[base->count], mod->mm);
+			*strchr(base->names[base->count], '=') = '\0';
+			base->count++;
+		}
+	}
+
+	for (e = environ; *e; e++) {
+		if (!(eq = strchr(*e, '=')))
+			continue;
+
+		base->names[base->count] = mmatic_strdup(*e, mod->mm);
+		base->names[base->count][eq - *e] = '\0';
+
+		/* config overrides */
+		for (i = 0; i < base->count; i++) {
+			if (streq(base->names[i], base->names[base->count]))
+				break;
+		}
+		if (i < base->count)
+			continue;
+
+		base->entries[base->count++] = mmatic_strdup(*e, mod->mm);
+	}
+
+	base->entries[base->count] = NULL;
+	uth_set_ptr(mod->prv, "env", base);
 	return true;
 }
 
+/** Write params to a sealed anonymous file, for use as stdin of the handler
+ * @param fmt    serialization format
+ * @param size   size of serialized params
+ * @retval -1    failed */
+static int params_fd(struct req *req, enum rpc_format fmt, size_t *size)
+{
+	const char *txt;
+	xstr *xs;
+	ssize_t r;
+	size_t len, done = 0;
+	int fd;
+
+	if (fmt == FMT_JSON) {
+		txt = json_print(json_create(req), req->params);
+		len = strlen(txt);
+	} else {
+		xs = binary_print(fmt, req->params, req);
+		txt = xstr_string(xs);
+		len = xstr_length(xs);
+	}
+
+	fd = memfd_create("rpcd-params", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd == -1)
+		fd = open("/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd == -1)
+		return -1;
+
+	while (done < len) {
+		r = write(fd, txt + done, len - done);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			close(fd);
+			return -1;
+		}
+		done += r;
+	}
+
+	/* the handler cannot modify it - does not matter if unsupported (O_TMPFILE) */
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+	lseek(fd, 0, SEEK_SET);
+
+	*size = len;
+	return fd;
+}
+
+/** Check if value should be passed in argv / environment
+ * @param max   max length of value, -1 means no limit */
+static bool mirror(ut *v, int max)
+{
+	if (max < 0)
+		return true;
+
+	switch (ut_type(v)) {
+		case T_LIST:
+		case T_HASH:
+			return false;
+		default:
+			return strlen(ut_char(v)) <= max;
+	}
+}
+
 static bool sh_handle(struct req *req)
 {
-	thash *env = NULL, *qh = NULL;
-	tlist *list = NULL;
+	struct shenv *base = ut_ptr(uth_get(req->mod->prv, "env"));
+	thash *env = NULL, *qh;
+	tlist *list;
 	ut *v;
-	char *k;
-	xstr *args = NULL;
+	char *k, *name, **argv, **envp;
+	const char *input;
+	enum rpc_format fmt = FMT_JSON;
+	int i, j, in = -1, max = -1, extra = 0;
+	size_t size = 0;
+
+	/* all params go to the script, even with "lazy_params" */
+	if (!rpcd_params(req))
+		return false;
+
+	/* whole params on stdin, only small scalars in argv / environment */
+	input = uth_char(req->mod->cfg, "input");
+	if (input) {
+		if (streq(input, "msgpack"))
+			fmt = FMT_MSGPACK;
+		else if (streq(input, "cbor"))
+			fmt = FMT_CBOR;
+		else
+			input = "json";
+
+		in = params_fd(req, fmt, &size);
+		if (in == -1)
+			return errsys("params_fd()");
+
+		max = uth_int(req->mod->cfg, "input_env_max");
+		if (max <= 0)
+			max = 256;
+
+		extra = 2;
+	}
 
 	switch (ut_type(req->params)) {
 		case T_LIST:
-			args = xstr_create("", req);
-
+			/* passed as-is, no shell in between */
 			list = ut_tlist(req->params);
-			TLIST_ITER_LOOP(list, v) {
-				xstr_append_char(args, '\'');
-				xstr_append(args, escape(ut_char(v)));
-				xstr_append_char(args, '\'');
-				xstr_append_char(args, ' ');
+			argv = mmatic_alloc((tlist_count(list) + 2) * sizeof *argv, req);
+
+			i = 0;
+			argv[i++] = (char *) req->mod->path;
+			TLIST_ITER_LOOP(list, v)
+				argv[i++] = mirror(v, max) ? ut_char(v) : "";
+			argv[i] = NULL;
+
+			if (extra) {
+				envp = mmatic_alloc((base->count + extra + 1) * sizeof *envp, req);
+				memcpy(envp + extra, base->entries, (base->count + 1) * sizeof *envp);
+			} else {
+				envp = base->entries;
 			}
 			break;
 
 		case T_HASH:
+			qh = ut_thash(req->params);
 			env = thash_create_strkey(NULL, req);
+			envp = mmatic_alloc((thash_count(qh) + base->count + extra + 1) * sizeof *envp, req);
 
-			qh = ut_thash(req->params);
+			i = extra;
 			THASH_ITER_LOOP(qh, k, v) {
-				thash_set(env,
-					asn_replace("/[^a-zA-Z0-9_]/", "_", k, req), ut_char(v));
+				if (!mirror(v, max))
+					continue;
+
+				envp[i] = envent(k, ut_char(v), req);
+
+				name = mmatic_strdup(envp[i], req);
+				*strchr(name, '=') = '\0';
+				thash_set(env, name, envp[i]);
+				i++;
 			}
+
+			/* parameters override the base */
+			for (j = 0; j < base->count; j++) {
+				if (!thash_get(env, base->names[j]))
+					envp[i++] = base->entries[j];
+			}
+			envp[i] = NULL;
+
+			argv = mmatic_alloc(2 * sizeof *argv, req);
+			argv[0] = (char *) req->mod->path;
+			argv[1] = NULL;
 			break;
 
 		default:
+			if (in != -1)
+				close(in);
 			return errcode(JSON_RPC_INVALID_INPUT);
 	}
 
+	if (extra) {
+		envp[0] = mmatic_printf(req, "RPCD_INPUT=%s", input);
+		envp[1] = mmatic_printf(req, "RPCD_INPUT_SIZE=%u", (unsigned int) size);
+	}
+
 	/* run the handler */
-	int rc;
-	xstr *out = xstr_create("", req);
+	int rc, timeout;
+	const char *mode;
+	struct output *o = NULL;
+	xstr *out = NULL;
 	xstr *err = xstr_create("", req);
 
-	rc = asn_cmd2(req->mod->path, xstr_string(args), env, NULL, out, err);
+	timeout = uth_int(req->mod->cfg, "timeout");
+	mode = uth_char(req->mod->cfg, "output");
+
+	if (mode && (streq(mode, "json") || streq(mode, "ndjson"))) {
+		o = mmatic_zalloc(sizeof *o, req);
+		o->req = req;
+		o->nd = streq(mode, "ndjson");
+		o->max = uth_int(req->mod->cfg, "max_output");
+		o->size = BUFSIZ;
+		o->buf = mmatic_alloc(o->size, req);
+		o->buf[0] = '\0';
+		if (o->nd)
+			o->items = tlist_create(NULL, req);
+
+		rc = run(argv, envp, in, output_sink, o, err, MAX(timeout, 0) * 1000);
+	} else {
+		out = xstr_create("", req);
+		rc = run(argv, envp, in, sink_xstr, out, err, MAX(timeout, 0) * 1000);
+	}
+
+	if (in != -1)
+		close(in);
+
+	if (rc == -1) {
+		return errsys("run()");
+	} else if (rc == -2) {
+		rpcd_timeout(req->mod);
+		return err(JSON_RPC_TIMEOUT, NULL, req->mod->path);
+	} else if (rc == -3) {
+		return err(JSON_RPC_OUT_PARSE_ERROR, "Output too large", req->mod->path);
+	}
+
+	if (o) {
+		if (rc != 0)
+			return err(rc, o->nd ? NULL : o->buf, xstr_string(err));
+
+		req->reply = output_finish(o);
+		if (!ut_ok(req->reply))
+			return err(ut_errcode(req->reply), NULL, xstr_string(err));
+
+		return true;
+	}
 
 	if (rc != 0)
 		return err(rc, xstr_string(out), xstr_string(err));
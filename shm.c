@@ -0,0 +1,536 @@
+/*
+ * Shared memory state and locks for cooperating rpcd processes
+ *
+ * Copyright (C) 2009-2010 Pawel Foremski <pawel@foremski.pl>
+ *
+ * Licensed under GPLv3
+ */
+
+#define _GNU_SOURCE 1
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include "common.h"
+
+#define SHM_MAGIC   0x13370005
+#define SHM_KEYS    256                /** number of key/value slots */
+#define SHM_LOCKS   64                 /** number of named lock slots */
+#define SHM_BUCKETS 4096               /** number of rate limiting buckets */
+#define SHM_PROBE   8                  /** how many buckets to look at for a key */
+#define SHM_KEYLEN  64                 /** max key and lock name length, including \0 */
+#define SHM_VALLEN  960                /** max value length, including \0 */
+
+/** Slot states: a claimed slot holds CLAIMED | pid of the claiming process, for recovery */
+enum { FREE = 0, READY = 1 };
+#define CLAIMED 0x80000000U
+
+/** Entry sequence word: pid of last writer and version, updated together */
+#define SEQ(pid, v) (((uint64_t) (uint32_t) (pid) << 32) | (uint32_t) (v))
+
+struct shm_entry {
+	uint32_t state;                    /** FREE, CLAIMED or READY */
+	int32_t len;                       /** value length, -1 if deleted */
+	uint64_t seq;                      /** SEQ(writer, version) - version even: stable, odd: write in progress */
+	char key[SHM_KEYLEN];
+	char val[SHM_VALLEN];
+};
+
+struct shm_lock {
+	uint32_t state;                    /** FREE, CLAIMED or READY */
+	char name[SHM_KEYLEN];
+	pthread_mutex_t mutex;             /** process-shared, robust */
+};
+
+/** Token bucket, updated with CAS only */
+struct shm_bucket {
+	uint64_t key;                      /** hash of bucket name, 0 if free */
+	uint64_t state;                    /** tokens (in 1/1000) << 32 | time of last update (ms) */
+	uint32_t full;                     /** time when bucket gets full again - may be reused then */
+};
+
+struct shm {
+	uint32_t magic;
+	struct shm_entry keys[SHM_KEYS];
+	struct shm_lock locks[SHM_LOCKS];
+	struct shm_bucket buckets[SHM_BUCKETS];
+	struct prio_state prio;
+	struct timing_stats timing;
+};
+
+static uint32_t hash(const char *str)
+{
+	uint32_t h = 2166136261U;
+
+	while (*str)
+		h = (h ^ (unsigned char) *str++) * 16777619U;
+
+	return h;
+}
+
+/** Wait until slot claimed by another process becomes ready
+ * Frees the slot if the claiming process died before making it ready.
+ * @retval READY  slot ready
+ * @retval FREE   slot was freed, look at it again */
+static uint32_t wait_ready(uint32_t *state)
+{
+	uint32_t s;
+
+	while ((s = *(volatile uint32_t *) state) & CLAIMED) {
+		if (kill(s & ~CLAIMED, 0) == -1 && errno == ESRCH &&
+			__sync_bool_compare_and_swap(state, s, FREE))
+			dbg(1, "process %u died while initializing shared slot\n", s & ~CLAIMED);
+		else
+			sched_yield();
+	}
+
+	return s;
+}
+
+/** Find slot of given name in table, optionally claiming a free one
+ * @param base      first slot
+ * @param size      size of one slot
+ * @param count     number of slots
+ * @param offset    offset of the name inside slot
+ * @param claimed   if not NULL, set to true if slot was claimed by us and needs init
+ * @retval NULL     not found, or table full */
+static void *lookup(void *base, size_t size, int count, size_t offset,
+	const char *name, bool *claimed)
+{
+	int i, n;
+	uint32_t *state;
+	char *slot;
+
+	for (i = hash(name) % count, n = 0; n < count; i = (i + 1) % count, n++) {
+		slot = (char *) base + i * size;
+		state = (uint32_t *) slot;
+
+		do {
+			if (*state == FREE) {
+				if (!claimed)
+					return NULL;
+
+				if (__sync_bool_compare_and_swap(state, FREE, CLAIMED | getpid())) {
+					strcpy(slot + offset, name);
+					*claimed = true;
+					return slot;
+				}
+			}
+		} while (wait_ready(state) == FREE);
+
+		if (streq(slot + offset, name))
+			return slot;
+	}
+
+	return NULL;
+}
+
+/** Map the segment on first use
+ * @retval NULL   failed */
+static struct shm *shm_get(struct rpcd *rpcd)
+{
+	const char *name = NULL;
+	struct shm *shm;
+	int fd;
+
+	if (rpcd->shm)
+		return rpcd->shm;
+
+	if (rpcd->cfg)
+		name = uth_char(rpcd->cfg, "shm");
+	name = mmatic_printf(rpcd, "/rpcd-%s", name ? name : "default");
+
+	fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+	if (fd == -1) {
+		dbg(0, "%s: shm_open() failed: %s\n", name, strerror(errno));
+		return NULL;
+	}
+
+	/* a fresh segment is all zeroes, which is a valid empty state */
+	if (ftruncate(fd, sizeof *shm) == -1) {
+		dbg(0, "%s: ftruncate() failed: %s\n", name, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	shm = mmap(NULL, sizeof *shm, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (shm == MAP_FAILED) {
+		dbg(0, "%s: mmap() failed: %s\n", name, strerror(errno));
+		return NULL;
+	}
+
+	if (!__sync_bool_compare_and_swap(&shm->magic, 0, SHM_MAGIC) && shm->magic != SHM_MAGIC) {
+		dbg(0, "%s: invalid magic - segment left by other rpcd version?\n", name);
+		munmap(shm, sizeof *shm);
+		return NULL;
+	}
+
+	dbg(3, "%s: mapped %u bytes\n", name, (unsigned int) sizeof *shm);
+	rpcd->shm = shm;
+	return shm;
+}
+
+/** Publish the value written after write_begin()
+ * @return          new version */
+static uint32_t write_end(struct shm_entry *e, uint32_t v)
+{
+	__sync_synchronize();
+	e->seq = SEQ(getpid(), v + 2);
+	return v + 2;
+}
+
+/** Wait for a stable version of entry
+ * Recovers entries left in the middle of write by a process that died.
+ * @return        sequence word, see SEQ() */
+static uint64_t stable(struct shm_entry *e)
+{
+	uint64_t s;
+	pid_t writer;
+
+	while ((s = *(volatile uint64_t *) &e->seq) & 1) {
+		writer = s >> 32;
+
+		/* the pid comes with the odd version, so it is the process that is writing now;
+		 * take its write over (still odd, now ours) and publish an empty value */
+		if (kill(writer, 0) == -1 && errno == ESRCH &&
+			__sync_bool_compare_and_swap(&e->seq, s, SEQ(getpid(), (uint32_t) s))) {
+			dbg(1, "%s: writer %d died, dropping value\n", e->key, (int) writer);
+			e->len = -1;
+			write_end(e, (uint32_t) s - 1);
+		}
+
+		sched_yield();
+	}
+
+	return s;
+}
+
+uint32_t rpcd_shm_get(struct rpcd *rpcd, const char *key, char **val, void *mm)
+{
+	struct shm *shm;
+	struct shm_entry *e;
+	uint64_t s;
+	char buf[SHM_VALLEN];
+	int len;
+
+	*val = NULL;
+
+	if (strlen(key) >= SHM_KEYLEN || !(shm = shm_get(rpcd)))
+		return 0;
+
+	e = lookup(shm->keys, sizeof *e, SHM_KEYS, offsetof(struct shm_entry, key), key, NULL);
+	if (!e)
+		return 0;
+
+	/* seqlock read: copy and retry if a writer got in the way */
+	do {
+		s = stable(e);
+		len = e->len;
+		if (len > 0)
+			memcpy(buf, e->val, len);
+		__sync_synchronize();
+	} while (*(volatile uint64_t *) &e->seq != s);
+
+	if (len >= 0) {
+		*val = mmatic_alloc(len + 1, mm);
+		memcpy(*val, buf, len);
+		(*val)[len] = '\0';
+	}
+
+	return (uint32_t) s;
+}
+
+/** Find entry of key, creating it if needed
+ * @retval NULL   no free slots left */
+static struct shm_entry *entry(struct shm *shm, const char *key)
+{
+	struct shm_entry *e;
+	bool claimed = false;
+
+	e = lookup(shm->keys, sizeof *e, SHM_KEYS, offsetof(struct shm_entry, key), key, &claimed);
+	if (!e)
+		return NULL;
+
+	if (claimed) {
+		e->len = -1;
+		__sync_synchronize();
+		e->state = READY;
+	}
+
+	return e;
+}
+
+/** Become the writer of entry: odd version and our pid in one step
+ * @param version   if not 0, fail unless entry is at this version
+ * @param v         set to current version, to be passed to write_end()
+ * @retval false    version did not match */
+static bool write_begin(struct shm_entry *e, uint32_t version, uint32_t *v)
+{
+	uint64_t s;
+
+	do {
+		s = stable(e);
+		*v = (uint32_t) s;
+		if (version && *v != version)
+			return false;
+	} while (!__sync_bool_compare_and_swap(&e->seq, s, SEQ(getpid(), *v + 1)));
+
+	return true;
+}
+
+uint32_t rpcd_shm_set(struct rpcd *rpcd, const char *key, const char *val, uint32_t version)
+{
+	struct shm *shm;
+	struct shm_entry *e;
+	uint32_t v;
+	int len = val ? strlen(val) : -1;
+
+	if (strlen(key) >= SHM_KEYLEN || len >= SHM_VALLEN) {
+		dbg(1, "%s: key or value too long\n", key);
+		return 0;
+	}
+
+	if (!(shm = shm_get(rpcd)))
+		return 0;
+
+	if (!(e = entry(shm, key))) {
+		dbg(1, "%s: no free slots left\n", key);
+		return 0;
+	}
+
+	if (!write_begin(e, version, &v))
+		return 0;
+
+	if (len > 0)
+		memcpy(e->val, val, len);
+	e->len = len;
+
+	return write_end(e, v);
+}
+
+bool shm_incr(struct rpcd *rpcd, const char *key)
+{
+	struct shm_entry *e;
+	char buf[24];
+	unsigned long n = 0;
+	uint32_t v;
+	int i;
+
+	if (!rpcd->shm || strlen(key) >= SHM_KEYLEN || !(e = entry(rpcd->shm, key)))
+		return false;
+
+	write_begin(e, 0, &v);
+
+	for (i = 0; i < e->len && e->val[i] >= '0' && e->val[i] <= '9'; i++)
+		n = n * 10 + (e->val[i] - '0');
+
+	/* no snprintf() here */
+	i = sizeof buf;
+	for (n++; n > 0; n /= 10)
+		buf[--i] = '0' + n % 10;
+
+	e->len = sizeof buf - i;
+	memcpy(e->val, buf + i, e->len);
+
+	write_end(e, v);
+	return true;
+}
+
+bool shm_init(struct rpcd *rpcd)
+{
+	return shm_get(rpcd) != NULL;
+}
+
+/** Initialize robust process-shared mutex */
+static void mutex_init(pthread_mutex_t *m)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(m, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+/** Find named lock, creating it if needed */
+static pthread_mutex_t *lock_get(struct rpcd *rpcd, const char *name)
+{
+	struct shm *shm;
+	struct shm_lock *l;
+	bool claimed = false;
+
+	if (strlen(name) >= SHM_KEYLEN || !(shm = shm_get(rpcd)))
+		return NULL;
+
+	l = lookup(shm->locks, sizeof *l, SHM_LOCKS, offsetof(struct shm_lock, name), name, &claimed);
+	if (!l) {
+		dbg(1, "%s: no free lock slots left\n", name);
+		return NULL;
+	}
+
+	if (claimed) {
+		mutex_init(&l->mutex);
+		__sync_synchronize();
+		l->state = READY;
+	}
+
+	return &l->mutex;
+}
+
+bool rpcd_lock(struct rpcd *rpcd, const char *name, bool wait)
+{
+	pthread_mutex_t *m;
+	int rc;
+
+	if (!(m = lock_get(rpcd, name)))
+		return false;
+
+	rc = wait ? pthread_mutex_lock(m) : pthread_mutex_trylock(m);
+	if (rc == EOWNERDEAD) {
+		dbg(1, "%s: previous owner died, recovering lock\n", name);
+		pthread_mutex_consistent(m);
+		rc = 0;
+	}
+
+	if (rc != 0 && rc != EBUSY)
+		dbg(1, "%s: locking failed: %s\n", name, strerror(rc));
+
+	return rc == 0;
+}
+
+bool rpcd_unlock(struct rpcd *rpcd, const char *name)
+{
+	pthread_mutex_t *m;
+
+	if (!(m = lock_get(rpcd, name)))
+		return false;
+
+	return pthread_mutex_unlock(m) == 0;
+}
+
+struct prio_state *shm_prio(struct rpcd *rpcd)
+{
+	struct shm *shm;
+
+	if (!(shm = shm_get(rpcd)))
+		return NULL;
+
+	do {
+		if (__sync_bool_compare_and_swap(&shm->prio.state, FREE, CLAIMED | getpid())) {
+			mutex_init(&shm->prio.mutex);
+			__sync_synchronize();
+			shm->prio.state = READY;
+		}
+	} while (wait_ready(&shm->prio.state) == FREE);
+
+	return &shm->prio;
+}
+
+struct timing_stats *shm_timing(struct rpcd *rpcd)
+{
+	struct shm *shm;
+
+	if (!(shm = shm_get(rpcd)))
+		return NULL;
+
+	return &shm->timing;
+}
+
+/** Monotonic time in ms, wrapping at 2^32 */
+static uint32_t ms32(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+bool rpcd_ratelimit(struct rpcd *rpcd, const char *name, double rate, int burst)
+{
+	struct shm *shm;
+	struct shm_bucket *b = NULL;
+	uint64_t key = 14695981039346656037ULL, old, state, next;
+	uint32_t now, tokens, cap;
+	int32_t elapsed;
+	double refill;
+	int i, n;
+
+	if (rate <= 0 || burst <= 0 || !(shm = shm_get(rpcd)))
+		return true;
+
+	/* 64-bit FNV-1a, 0 is reserved */
+	for (; *name; name++)
+		key = (key ^ (unsigned char) *name) * 1099511628211ULL;
+	if (!key) key = 1;
+
+	now = ms32();
+	cap = MIN(burst, 4000000) * 1000;
+
+	/* find bucket */
+	for (i = key % SHM_BUCKETS, n = 0; n < SHM_PROBE; i = (i + 1) % SHM_BUCKETS, n++) {
+		if (shm->buckets[i].key == key) {
+			b = &shm->buckets[i];
+			break;
+		}
+	}
+
+	/* take over a free or stale one: reset its state, then swap the key - if another process
+	 * touched the bucket in between, one of the CASes fails and we look further */
+	for (i = key % SHM_BUCKETS, n = 0; !b && n < SHM_PROBE; i = (i + 1) % SHM_BUCKETS, n++) {
+		state = shm->buckets[i].state;
+		__sync_synchronize();
+		old = shm->buckets[i].key;
+
+		if (old == key ||
+			((old == 0 || (int32_t) (now - shm->buckets[i].full) >= 0) &&
+			__sync_bool_compare_and_swap(&shm->buckets[i].state, state, ((uint64_t) cap << 32) | now) &&
+			__sync_bool_compare_and_swap(&shm->buckets[i].key, old, key)))
+			b = &shm->buckets[i];
+	}
+
+	if (!b) {
+		dbg(1, "no free rate limiting buckets, letting request through\n");
+		return true;
+	}
+
+	do {
+		state = b->state;
+		tokens = state >> 32;
+
+		/* another process may have updated the bucket with a later timestamp */
+		elapsed = (int32_t) (now - (uint32_t) state);
+		refill = (double) MAX(elapsed, 0) * rate;
+		tokens = MIN((double) cap, tokens + refill);
+
+		if (tokens < 1000)
+			return false;
+
+		tokens -= 1000;
+		next = ((uint64_t) tokens << 32) | (elapsed < 0 ? (uint32_t) state : now);
+
+		/* before the state, so that nobody sees it consumed and the bucket stale */
+		b->full = now + (uint32_t) ((cap - tokens) / rate) + 1;
+	} while (!__sync_bool_compare_and_swap(&b->state, state, next));
+
+	return true;
+}
+
+void shm_deinit(struct rpcd *rpcd)
+{
+	if (rpcd->shm) {
+		munmap(rpcd->shm, sizeof *rpcd->shm);
+		rpcd->shm = NULL;
+	}
+}
+
+/* for Vim autocompletion:
+ * vim: path=.,/usr/include,/usr/local/include,~/local/include
+ */
@@ -0,0 +1,32 @@
+/*
+ * Shared memory state and locks for cooperating rpcd processes
+ *
+ * Copyright (C) 2009-2010 Pawel Foremski <pawel@foremski.pl>
+ *
+ * Licensed under GPLv3
+ */
+
+#ifndef _SHM_H_
+#define _SHM_H_
+
+/** Get scheduler state in shared memory, see prio.c
+ * @retval NULL   shared memory not available */
+struct prio_state *shm_prio(struct rpcd *rpcd);
+
+/** Get timing histograms in shared memory, see timing.c
+ * @retval NULL   shared memory not available */
+struct timing_stats *shm_timing(struct rpcd *rpcd);
+
+/** Map shared memory segment now, eg. before shm_incr() is needed in a signal handler
+ * @retval false  shared memory not available */
+bool shm_init(struct rpcd *rpcd);
+
+/** Increment integer value of key, creating it if needed
+ * Async-signal-safe: does not allocate memory, nor map the segment - see shm_init().
+ * @retval false  segment not mapped yet, or no free slots */
+bool shm_incr(struct rpcd *rpcd, const char *key);
+
+/** Unmap shared memory segment, if mapped */
+void shm_deinit(struct rpcd *rpcd);
+
+#endif
@@ -28,12 +28,24 @@ enum json_errcode {
 	JSON_RPC_HTTP_GET        = -32094,
 	JSON_RPC_HTTP_NOT_FOUND  = -32093,
 	JSON_RPC_ERROR           = -32092,
+	JSON_RPC_OVERLOADED      = -32091,
+	JSON_RPC_TIMEOUT         = -32090,
+	JSON_RPC_RATE_LIMITED    = -32089,
+	JSON_RPC_HTTP_UPGRADE    = -32088,
 };
 
 enum http_type {
 	POST,
 	GET,
-	OPTIONS
+	OPTIONS,
+	GETRPC,
+	UPGRADE
+};
+
+enum rpc_format {
+	FMT_JSON = 0,
+	FMT_MSGPACK,
+	FMT_CBOR
 };
 
 #define RFC_DATETIME "%a, %d %b %Y %H:%M:%S GMT"
@@ -0,0 +1,152 @@
+/*
+ * Per-request phase timing, with sampling
+ *
+ * Only sampled requests get a struct timing, so the cost for others is a NULL check per phase.
+ * Durations of sampled requests go to log2 histograms in shared memory, common for all rpcd
+ * processes - see rpcd_timing_stats().
+ *
+ * Copyright (C) 2009-2010 Pawel Foremski <pawel@foremski.pl>
+ *
+ * Licensed under GPLv3
+ */
+
+#define _GNU_SOURCE 1
+
+#include <time.h>
+#include <unistd.h>
+#include "common.h"
+
+static const char *names[TIMING_PHASES] = {
+	"read", "auth", "queue", "fw", "common", "handle", "serialize", "write"
+};
+
+/** Microseconds since some point in the past */
+static long long usnow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/** Get duration of phase
+ * @retval -1    phase skipped */
+static long long duration(struct timing *tm, enum timing_phase ph)
+{
+	int i;
+
+	if (!tm->t[ph + 1])
+		return -1;
+
+	/* phase started when the last recorded one ended */
+	for (i = ph; i > 0 && !tm->t[i]; i--);
+
+	return tm->t[ph + 1] - tm->t[i];
+}
+
+void timing_sample(struct req *req, double rate)
+{
+	static bool seeded = false;
+
+	if (rate <= 0.0)
+		return;
+
+	/* each connection is a new process - do not let them all sample the same requests */
+	if (!seeded) {
+		srand48(getpid() ^ usnow());
+		seeded = true;
+	}
+
+	if (rate < 1.0 && drand48() >= rate)
+		return;
+
+	req->timing = mmatic_zalloc(sizeof *req->timing, req);
+	req->timing->t[0] = usnow();
+}
+
+void timing_start(struct req *req)
+{
+	if (req->timing)
+		req->timing->t[0] = usnow();
+}
+
+void timing_set(struct timing *tm, enum timing_phase ph)
+{
+	tm->t[ph + 1] = usnow();
+}
+
+const char *timing_format(struct req *req)
+{
+	struct timing *tm = req->timing;
+	char buf[256];
+	long long d, last = 0;
+	int ph, len = 0;
+
+	if (!tm)
+		return NULL;
+
+	for (ph = 0; ph < TIMING_PHASES; ph++) {
+		if ((d = duration(tm, ph)) < 0)
+			continue;
+
+		len += snprintf(buf + len, sizeof buf - len, "%s=%lld ", names[ph], d);
+		last = tm->t[ph + 1];
+	}
+
+	snprintf(buf + len, sizeof buf - len, "total=%lld", last ? last - tm->t[0] : 0);
+	return mmatic_strdup(buf, req);
+}
+
+void timing_done(struct rpcd *rpcd, struct req *req)
+{
+	struct timing_stats *st;
+	long long d;
+	int ph, b;
+
+	if (!req->timing)
+		return;
+
+	dbg(3, "timing %s: %s\n", req->method ? req->method : "-", timing_format(req));
+
+	if (!(st = shm_timing(rpcd)))
+		return;
+
+	for (ph = 0; ph < TIMING_PHASES; ph++) {
+		if ((d = duration(req->timing, ph)) < 0)
+			continue;
+
+		b = (d > 0) ? 64 - __builtin_clzll(d) : 0;
+		__sync_fetch_and_add(&st->hist[ph][MIN(b, TIMING_BUCKETS - 1)], 1);
+	}
+
+	__sync_fetch_and_add(&st->samples, 1);
+}
+
+ut *rpcd_timing_stats(struct rpcd *rpcd, void *mm)
+{
+	struct timing_stats *st;
+	tlist *list;
+	ut *ret;
+	int ph, b;
+
+	if (!(st = shm_timing(rpcd)))
+		return NULL;
+
+	ret = ut_new_thash(NULL, mm);
+	uth_set_int(ret, "samples", st->samples);
+
+	for (ph = 0; ph < TIMING_PHASES; ph++) {
+		list = tlist_create(NULL, ret);
+
+		for (b = 0; b < TIMING_BUCKETS; b++)
+			tlist_push(list, ut_new_int(st->hist[ph][b], ret));
+
+		uth_set_tlist(ret, names[ph], list);
+	}
+
+	return ret;
+}
+
+/* for Vim autocompletion:
+ * vim: path=.,/usr/include,/usr/local/include,~/local/include
+ */
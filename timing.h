@@ -0,0 +1,63 @@
+/*
+ * Per-request phase timing, with sampling
+ *
+ * Copyright (C) 2009-2010 Pawel Foremski <pawel@foremski.pl>
+ *
+ * Licensed under GPLv3
+ */
+
+#ifndef _TIMING_H_
+#define _TIMING_H_
+
+#include <stdint.h>
+
+/** Phases of request handling, in order */
+enum timing_phase {
+	TIMING_READ = 0,                   /** reading and parsing the request */
+	TIMING_AUTH,                       /** HTTP authentication */
+	TIMING_QUEUE,                      /** rate limits, scheduler and concurrency limits */
+	TIMING_FW,                         /** parsing lazy params, generic_fw() checks */
+	TIMING_COMMON,                     /** handle() of the common module */
+	TIMING_HANDLE,                     /** handle() of the method */
+	TIMING_SERIALIZE,                  /** making the reply */
+	TIMING_WRITE,                      /** sending the reply */
+	TIMING_PHASES
+};
+
+#define TIMING_BUCKETS 32             /** histogram buckets: bucket n counts durations < 2^n us */
+
+/** Histograms of sampled requests, kept in shared memory - see shm.c */
+struct timing_stats {
+	uint32_t samples;                  /** number of sampled requests */
+	uint32_t hist[TIMING_PHASES][TIMING_BUCKETS];
+};
+
+/** Timestamps of a sampled request */
+struct timing {
+	long long t[TIMING_PHASES + 1];    /** t[0]: start, t[n + 1]: end of phase n, 0 if phase skipped */
+};
+
+/** Decide if req should be timed
+ * @param rate    fraction of requests to time, 0.0 - 1.0 */
+void timing_sample(struct req *req, double rate);
+
+/** Set start time of req to now, eg. after waiting for the request on a kept-alive connection */
+void timing_start(struct req *req);
+
+/** Record end of phase ph */
+void timing_set(struct timing *tm, enum timing_phase ph);
+
+static inline void timing_mark(struct req *req, enum timing_phase ph)
+{
+	if (req->timing)
+		timing_set(req->timing, ph);
+}
+
+/** Format durations of phases so far, eg. "read=12 auth=0 ... total=345" (in us)
+ * @retval NULL   req not timed */
+const char *timing_format(struct req *req);
+
+/** Add durations of req to histograms in shared memory */
+void timing_done(struct rpcd *rpcd, struct req *req);
+
+#endif
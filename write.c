@@ -10,41 +10,407 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <math.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+
+/** Output buffer, reused for all replies on this connection */
+static struct {
+	char *buf;                         /** contents */
+	size_t len;                        /** length of contents */
+	size_t size;                       /** allocated size */
+} out;
+
+/** Make room for n more bytes in out */
+static inline void out_reserve(size_t n)
+{
+	if (out.len + n <= out.size)
+		return;
+
+	out.size = MAX(MAX(out.size * 2, out.len + n), BUFSIZ);
+	out.buf = realloc(out.buf, out.size);
+
+	if (!out.buf) {
+		dbg(0, "out of memory\n");
+		exit(1);
+	}
+}
+
+static inline void out_put(const char *p, size_t n)
+{
+	out_reserve(n);
+	memcpy(out.buf + out.len, p, n);
+	out.len += n;
+}
 
-static char *common(struct req *req)
+#define out_lit(str) out_put((str), sizeof(str) - 1)
+
+/** If not NULL, send2() appends here instead of writing - see writecapture() */
+static xstr *capture;
+
+/** Put JSON string, escaping as needed */
+static void out_string(const char *p, size_t len)
 {
-	json *js = json_create(req);
-	ut *rep = ut_new_thash(NULL, req);
+	static const char hex[] = "0123456789abcdef";
+	size_t n;
+	unsigned char c;
+
+	out_reserve(len + 2);
+	out.buf[out.len++] = '"';
+
+	while (len > 0) {
+		/* copy the longest run not needing escapes */
+		n = fastjson_scan(p, len);
+		out_put(p, n);
+		p += n;
+		len -= n;
+
+		if (len == 0)
+			break;
+
+		c = *p++;
+		len--;
+
+		switch (c) {
+			case '"':  out_lit("\\\""); break;
+			case '\\': out_lit("\\\\"); break;
+			case '\n': out_lit("\\n"); break;
+			case '\r': out_lit("\\r"); break;
+			case '\t': out_lit("\\t"); break;
+			case '\b': out_lit("\\b"); break;
+			case '\f': out_lit("\\f"); break;
+			default:
+				if (c < 0x20) {
+					out_lit("\\u00");
+					out_reserve(2);
+					out.buf[out.len++] = hex[c >> 4];
+					out.buf[out.len++] = hex[c & 0xf];
+				} else {
+					/* UTF-8, passed as-is */
+					out_put((const char *) &c, 1);
+				}
+				break;
+		}
+	}
 
-	uth_set_char(rep, "jsonrpc", "2.0");
-	if (req->id)
-		uth_set_char(rep, "id", req->id);
+	out_reserve(1);
+	out.buf[out.len++] = '"';
+}
+
+/** Put shortest of %.15g, %.16g and %.17g that reads back as d - %.17g alone gives eg. 0.10000000000000001 */
+static void out_double(double d)
+{
+	int prec, n;
+
+	out_reserve(32);
+	for (prec = 15; prec <= 17; prec++) {
+		n = snprintf(out.buf + out.len, 32, "%.*g", prec, d);
+		if (strtod(out.buf + out.len, NULL) == d)
+			break;
+	}
+
+	out.len += n;
+}
+
+/** Put JSON representation of obj */
+static void out_json(ut *obj, void *mm)
+{
+	const char *k;
+	xstr *xs;
+	ut *v;
+	bool first = true;
+	double d;
+
+	switch (ut_type(obj)) {
+		case T_BOOL:
+			if (ut_bool(obj)) out_lit("true");
+			else out_lit("false");
+			break;
+
+		case T_INT:
+			out_reserve(16);
+			out.len += sprintf(out.buf + out.len, "%d", ut_int(obj));
+			break;
+
+		case T_DOUBLE:
+			d = ut_double(obj);
+			if (isfinite(d)) {
+				out_double(d);
+			} else {
+				out_lit("null");
+			}
+			break;
+
+		case T_STRING:
+			xs = ut_xstr(obj);
+			out_string(xstr_string(xs), xstr_length(xs));
+			break;
+
+		case T_LIST:
+			out_lit("[");
+			TLIST_ITER_LOOP(ut_tlist(obj), v) {
+				if (!first) out_lit(",");
+				out_json(v, mm);
+				first = false;
+			}
+			out_lit("]");
+			break;
+
+		case T_HASH:
+			out_lit("{");
+			THASH_ITER_LOOP(ut_thash(obj), k, v) {
+				if (!first) out_lit(",");
+				out_string(k, strlen(k));
+				out_lit(":");
+				out_json(v, mm);
+				first = false;
+			}
+			out_lit("}");
+			break;
+
+		case T_ERR:
+			/* rare, leave the details to libpjf */
+			k = json_print(json_create(mm), obj);
+			out_put(k, strlen(k));
+			break;
+
+		case T_NULL:
+		case T_PTR:
+			out_lit("null");
+			break;
+	}
+}
+
+/** Serialize reply in req->format
+ * JSON goes straight to the output buffer, without building the envelope object first.
+ * @param len     set to length of returned buffer */
+static const char *common(struct req *req, size_t *len)
+{
+	const char *ms;
+	ut *rep;
+	xstr *xs;
+
+	if (req->format != FMT_JSON) {
+		rep = ut_new_thash(NULL, req);
+		uth_set_char(rep, "jsonrpc", "2.0");
+		if (req->id)
+			uth_set_char(rep, "id", req->id);
+		uth_set(rep, ut_ok(req->reply) ? "result" : "error", req->reply);
+
+		xs = binary_print(req->format, rep, req);
+		*len = req->outsize = xstr_length(xs);
+		timing_mark(req, TIMING_SERIALIZE);
+		return xstr_string(xs);
+	}
+
+	out.len = 0;
+	out_lit("{\"jsonrpc\":\"2.0\",");
+	if (req->id) {
+		out_lit("\"id\":");
+		out_string(req->id, strlen(req->id));
+		out_lit(",");
+	}
+
+	if (ut_ok(req->reply))
+		out_lit("\"result\":");
+	else
+		out_lit("\"error\":");
+	out_json(req->reply, req);
+
+	/* HTTP has the X-Rpcd-Timing header for this */
+	if (O.timingreply && req->timing && O.mode != RPCD_HTTP) {
+		out_lit(",\"timing\":");
+		ms = timing_format(req);
+		out_string(ms, strlen(ms));
+	}
+
+	out_lit("}");
+
+	*len = req->outsize = out.len;
+	timing_mark(req, TIMING_SERIALIZE);
+	return out.buf;
+}
+
+/** Write head and body to stdout, in one syscall if possible */
+static void send2(const char *head, size_t hlen, const char *body, size_t blen)
+{
+	struct iovec iov[2] = {
+		{ (void *) head, hlen },
+		{ (void *) body, blen }
+	};
+	struct iovec *v = iov;
+	int cnt = 2;
+	ssize_t r;
+
+	if (capture) {
+		xstr_append_size(capture, head, hlen);
+		xstr_append_size(capture, body, blen);
+		return;
+	}
 
-	uth_set(rep, ut_ok(req->reply) ? "result" : "error", req->reply);
+	/* anything left by printf() users, eg. writehttp_get() */
+	fflush(stdout);
 
-	return json_print(js, rep);
+	while (cnt > 0) {
+		r = writev(1, v, cnt);
+		if (r == -1) {
+			if (errno == EINTR) continue;
+			return;
+		}
+
+		while (cnt > 0 && r >= v->iov_len) {
+			r -= v->iov_len;
+			v++;
+			cnt--;
+		}
+
+		if (cnt > 0) {
+			v->iov_base = (char *) v->iov_base + r;
+			v->iov_len -= r;
+		}
+	}
 }
 
 void writejson(struct req *req)
 {
-	char *txt = common(req);
+	size_t len;
+
+	common(req, &len);
+	out_lit("\n\n");
+	req->outsize = out.len;
+	send2(NULL, 0, out.buf, out.len);
+}
+
+void writebinary(struct req *req)
+{
+	size_t len;
+	const char *txt = common(req, &len);
+
+	send2(NULL, 0, txt, len);
+}
+
+void writews_frame(enum ws_opcode op, const char *data, size_t len)
+{
+	unsigned char head[10];
+	int hlen, i;
+
+	/* never fragmented, never masked */
+	head[0] = 0x80 | op;
+
+	if (len < 126) {
+		head[1] = len;
+		hlen = 2;
+	} else if (len < 65536) {
+		head[1] = 126;
+		head[2] = len >> 8;
+		head[3] = len;
+		hlen = 4;
+	} else {
+		head[1] = 127;
+		for (i = 0; i < 8; i++)
+			head[2 + i] = (uint64_t) len >> (56 - 8 * i);
+		hlen = 10;
+	}
 
-	write(1, txt, strlen(txt));
-	write(1, "\n\n", 2);
+	send2((char *) head, hlen, data, len);
+}
+
+void writews(struct req *req)
+{
+	size_t len;
+	const char *txt = common(req, &len);
+
+	/* replies carry the id, so clients can match them in any order */
+	writews_frame(req->format == FMT_JSON ? WS_TEXT : WS_BINARY, txt, len);
+	req->outsize = len + (len < 126 ? 2 : len < 65536 ? 4 : 10);
+}
+
+/** Accept WebSocket upgrade and switch the connection over to readws() and writews() */
+static void upgrade(struct req *req)
+{
+	const char *head;
+	int one = 1;
+
+	/* RFC 6455 wants CRLFs here */
+	head = mmatic_printf(req,
+		"HTTP/1.1 101 Switching Protocols\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Accept: %s\r\n"
+		"\r\n",
+		ws_accept(req->http.ws_key, req));
+
+	req->outsize = strlen(head);
+	send2(head, req->outsize, NULL, 0);
+
+	/* keep the user authenticated by handle() for all messages, see readws() */
+	if (req->user) {
+		O.http.user = strdup(req->user);
+		O.http.pass = req->pass ? strdup(req->pass) : NULL;
+	}
+
+	/* no idle timeout from now on - let TCP find dead peers */
+	setsockopt(0, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof one);
+
+	O.mode = RPCD_WEBSOCKET;
+	O.read = readws;
+	O.write = writews;
+
+	/* keep-alive limits do not apply */
+	req->last = false;
 }
 
 void write822(struct req *req)
 {
+	xstr *xs = xstr_create("", req);
 	char *k;
 	ut *v;
 
 	if (ut_type(req->reply) == T_HASH) {
 		THASH_ITER_LOOP(ut_thash(req->reply), k, v)
-			printf("%s: %s\n", k, ut_char(v));
-		write(1, "\n", 1);
+			xstr_append(xs, mmatic_printf(req, "%s: %s\n", k, ut_char(v)));
+		xstr_append(xs, "\n");
 	} else {
-		printf("result: %s\n\n", ut_char(req->reply));
+		xstr_append(xs, mmatic_printf(req, "result: %s\n\n", ut_char(req->reply)));
 	}
+
+	send2(NULL, 0, xstr_string(xs), xstr_length(xs));
+}
+
+const char *writecapture(struct req *req, size_t *len)
+{
+	struct timing *timing = req->timing;
+	unsigned int outsize = req->outsize;
+	const char *txt;
+
+	/* not a phase of this request */
+	req->timing = NULL;
+
+	capture = xstr_create("", req);
+	O.write(req);
+
+	txt = xstr_string(capture);
+	*len = xstr_length(capture);
+	capture = NULL;
+
+	req->timing = timing;
+	req->outsize = outsize;
+	return txt;
+}
+
+/** Connection and Keep-Alive HTTP headers */
+static const char *connection(struct req *req)
+{
+	if (req->last)
+		return "Connection: Close\n";
+
+	if (O.http.maxreq > 0)
+		return mmatic_printf(req, "Connection: Keep-alive\nKeep-Alive: timeout=%d, max=%d\n",
+			O.http.idle, O.http.maxreq - O.http.requests);
+	else if (O.http.idle > 0)
+		return mmatic_printf(req, "Connection: Keep-alive\nKeep-Alive: timeout=%d\n", O.http.idle);
+	else
+		return "Connection: Keep-alive\n";
 }
 
 bool writehttp_get(struct req *req)
@@ -54,7 +420,8 @@ bool writehttp_get(struct req *req)
 	const char *type = "application/octet-stream";
 	char date[128];
 	struct stat ss;
-	char *ms, *ext, buf[BUFSIZ];
+	const char *ms;
+	char *ext, buf[BUFSIZ];
 	int fd = 0, r;
 	time_t now;
 	struct tm mod_client;
@@ -69,7 +436,7 @@ bool writehttp_get(struct req *req)
 	gmtime_r(&ss.st_mtime, &mod_server);
 
 	/* dont open the file if client is up to date */
-	if ((ms = thash_get(req->http.headers, "If-Modified-Since")) &&
+	if ((ms = req->http.if_modified_since) &&
 		strptime(ms, RFC_DATETIME, &mod_client) != NULL &&
 		mktime(&mod_client) >= mktime(&mod_server)) {
 		code = 304;
@@ -84,7 +451,7 @@ bool writehttp_get(struct req *req)
 	/* say hello */
 	printf("HTTP/1.1 %u %s\n", code, msg);
 	printf("Server: rpcd\n");
-	printf("Connection: %s\n", req->last ? "Close" : "Keep-alive");
+	printf("%s", connection(req));
 
 	strftime(date, sizeof date, RFC_DATETIME, gmtime(&now));
 	printf("Date: %s\n", date);
@@ -121,11 +488,43 @@ bool writehttp_get(struct req *req)
 	return true;
 }
 
+/** Make caching headers for reply to GET /rpc/<method>, see "cache" in module config
+ * ETag is a FNV-1a hash of the serialized reply.
+ * @param header   set to the headers
+ * @retval true    client already has this reply */
+static bool cache(struct req *req, const char *txt, size_t len, const char **header)
+{
+	ut *cfg = uth_get(req->mod->cfg, "cache");
+	uint64_t h = 14695981039346656037ULL;
+	const char *inm = req->http.if_none_match;
+	char etag[24];
+	bool user;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char) txt[i];
+		h *= 1099511628211ULL;
+	}
+
+	snprintf(etag, sizeof etag, "\"%016llx\"", (unsigned long long) h);
+
+	/* replies depending on who asks must not be shared */
+	user = uth_bool(cfg, "per_user");
+	*header = mmatic_printf(req, "ETag: %s\nCache-Control: %s, max-age=%d\n%s",
+		etag, user ? "private" : "public", MAX(uth_int(cfg, "max_age"), 0),
+		user ? "Vary: Authorization\n" : "");
+
+	return inm && (streq(inm, "*") || strstr(inm, etag));
+}
+
 void writehttp(struct req *req)
 {
 	int code = 200;
-	char *msg = "OK", *txt = "", *header = "";
-	const char *type = "application/json-rpc";
+	char *msg = "OK";
+	const char *header = "";
+	const char *txt = "", *type = "application/json-rpc";
+	size_t len, hlen;
+	const char *head;
 	time_t now;
 	char date[128];
 
@@ -147,6 +546,23 @@ void writehttp(struct req *req)
 			}
 			break;
 
+		case JSON_RPC_OVERLOADED:
+			code = 503;
+			msg = "Service Unavailable";
+			header = "Retry-After: 1\n";
+			break;
+
+		case JSON_RPC_RATE_LIMITED:
+			code = 429;
+			msg = "Too Many Requests";
+			header = "Retry-After: 1\n";
+			break;
+
+		case JSON_RPC_TIMEOUT:
+			code = 504;
+			msg = "Gateway Timeout";
+			break;
+
 		case JSON_RPC_HTTP_NOT_FOUND:
 			code = 404;
 			msg = "Not Found";
@@ -160,6 +576,10 @@ void writehttp(struct req *req)
 			header = "Allow: GET,POST,OPTIONS\n";
 			goto printtxt;
 
+		case JSON_RPC_HTTP_UPGRADE:
+			upgrade(req);
+			return;
+
 		case JSON_RPC_HTTP_GET:
 			if (writehttp_get(req)) {
 				return;
@@ -173,23 +593,79 @@ void writehttp(struct req *req)
 			break;
 	}
 
-	txt = common(req);
+	/* JSON-RPC notification: nothing to say, just let the client go on */
+	if (req->notify && code == 200) {
+		head = mmatic_printf(req,
+			"HTTP/1.1 204 No Content\n"
+			"Server: rpcd\n"
+			"Date: %s\n"
+			"%s"
+			"\n",
+			date, connection(req));
+
+		hlen = strlen(head);
+		req->outsize = hlen;
+		send2(head, hlen, NULL, 0);
+		return;
+	}
+
+	txt = common(req, &len);
+
+	/* binary formats are not followed by a newline */
+	if (req->format != FMT_JSON) {
+		type = binary_mime(req->format);
+	} else {
+		out_lit("\n");
+		txt = out.buf;
+		len = out.len;
+	}
+
+	if (req->http.get) {
+		if (!ut_ok(req->reply) || !req->mod) {
+			header = mmatic_printf(req, "%sCache-Control: no-store\n", header);
+		} else if (cache(req, txt, len, &header)) {
+			head = mmatic_printf(req,
+				"HTTP/1.1 304 Not Modified\n"
+				"Server: rpcd\n"
+				"Date: %s\n"
+				"%s"
+				"%s"
+				"\n",
+				date, connection(req), header);
+
+			hlen = strlen(head);
+			req->outsize = hlen;
+			send2(head, hlen, NULL, 0);
+			return;
+		}
+	}
+	goto printbuf;
 
 printtxt:
-	printf(
+	out.len = 0;
+	out_put(txt, strlen(txt));
+	out_lit("\n");
+	txt = out.buf;
+	len = out.len;
+
+printbuf:
+	if (O.timingreply && req->timing)
+		header = mmatic_printf(req, "%sX-Rpcd-Timing: %s\n", header, timing_format(req));
+
+	head = mmatic_printf(req,
 		"HTTP/1.1 %d %s\n"
 		"Server: rpcd\n"
 		"Date: %s\n"
-		"Connection: %s\n"
+		"%s"
 		"%s"
 		"Content-Type: %s\n"
-		"Content-Length: %d\n"
-		"\n"
-		"%s\n",
+		"Content-Length: %u\n"
+		"\n",
 		code, msg, date,
-		(req->last ? "Close" : "Keep-alive"),
-		header, type, (int) strlen(txt) + 1,
-		txt);
+		connection(req),
+		header, type, (unsigned int) len);
 
-	fflush(stdout);
+	hlen = strlen(head);
+	req->outsize = hlen + len;
+	send2(head, hlen, txt, len);
 }
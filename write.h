@@ -7,7 +7,17 @@
 #define _WRITE_H_
 
 void writejson(struct req *req);
+void writebinary(struct req *req);
 void write822(struct req *req);
 void writehttp(struct req *req);
+void writews(struct req *req);
+
+/** Serialize reply into memory instead of writing it
+ * @param len     set to length of returned buffer
+ * @return        exactly what O.write() would send, in req memory */
+const char *writecapture(struct req *req, size_t *len);
+
+/** Write single WebSocket frame, see ws.h */
+void writews_frame(enum ws_opcode op, const char *data, size_t len);
 
 #endif
@@ -0,0 +1,100 @@
+/*
+ * WebSocket support
+ *
+ * The upgrade request is handled by readhttp() and writehttp(), which then switch the connection
+ * over to readws() and writews(). This file only holds the handshake hashing, RFC 6455 section 4.2.2.
+ *
+ * Copyright (C) 2009-2010 Pawel Foremski <pawel@foremski.pl>
+ *
+ * Licensed under GPLv3
+ */
+
+#include <stdint.h>
+#include "common.h"
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_block(uint32_t h[5], const unsigned char *p)
+{
+	uint32_t w[80], a, b, c, d, e, f, k, t;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t) p[4*i] << 24 | p[4*i + 1] << 16 | p[4*i + 2] << 8 | p[4*i + 3];
+	for (; i < 80; i++)
+		w[i] = ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+	a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+
+	for (i = 0; i < 80; i++) {
+		if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5A827999; }
+		else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+		else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+		else             { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+
+		t = ROL(a, 5) + f + e + k + w[i];
+		e = d; d = c; c = ROL(b, 30); b = a; a = t;
+	}
+
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+/** SHA-1 of short message */
+static void sha1(const char *msg, size_t len, unsigned char out[20])
+{
+	uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	unsigned char block[64];
+	uint64_t bits = (uint64_t) len * 8;
+	size_t i, rest;
+
+	for (i = 0; i + 64 <= len; i += 64)
+		sha1_block(h, (const unsigned char *) msg + i);
+
+	/* padding: 0x80, zeros, length in bits */
+	rest = len - i;
+	memset(block, 0, sizeof block);
+	memcpy(block, msg + i, rest);
+	block[rest] = 0x80;
+
+	if (rest >= 56) {
+		sha1_block(h, block);
+		memset(block, 0, sizeof block);
+	}
+
+	for (i = 0; i < 8; i++)
+		block[63 - i] = bits >> (8 * i);
+	sha1_block(h, block);
+
+	for (i = 0; i < 20; i++)
+		out[i] = h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+const char *ws_accept(const char *key, void *mm)
+{
+	static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	unsigned char d[21];
+	char *ret, *p;
+	int i;
+
+	sha1(mmatic_printf(mm, "%s" WS_GUID, key), strlen(key) + sizeof WS_GUID - 1, d);
+	d[20] = 0;
+
+	/* 20 bytes: 6 full groups and 2 bytes left */
+	p = ret = mmatic_alloc(29, mm);
+	for (i = 0; i < 21; i += 3) {
+		*p++ = b64[d[i] >> 2];
+		*p++ = b64[((d[i] & 3) << 4) | (d[i + 1] >> 4)];
+		*p++ = b64[((d[i + 1] & 15) << 2) | (d[i + 2] >> 6)];
+		*p++ = b64[d[i + 2] & 63];
+	}
+
+	ret[27] = '=';
+	ret[28] = '\0';
+	return ret;
+}
+
+/* for Vim autocompletion:
+ * vim: path=.,/usr/include,/usr/local/include,~/local/include
+ */
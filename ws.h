@@ -0,0 +1,30 @@
+/*
+ * WebSocket support, see ws.c
+ *
+ * Copyright (C) 2009-2010 Pawel Foremski <pawel@foremski.pl>
+ *
+ * Licensed under GPLv3
+ */
+
+#ifndef _WS_H_
+#define _WS_H_
+
+/** WebSocket frame opcodes */
+enum ws_opcode {
+	WS_CONT  = 0x0,
+	WS_TEXT  = 0x1,
+	WS_BINARY = 0x2,
+	WS_CLOSE = 0x8,
+	WS_PING  = 0x9,
+	WS_PONG  = 0xA
+};
+
+/** WebSocket close status codes */
+#define WS_CLOSE_NORMAL    1000
+#define WS_CLOSE_PROTOCOL  1002
+#define WS_CLOSE_TOOBIG    1009
+
+/** Compute Sec-WebSocket-Accept for given Sec-WebSocket-Key */
+const char *ws_accept(const char *key, void *mm);
+
+#endif